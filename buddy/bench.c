@@ -0,0 +1,1085 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/*
+ * The workloads run in their own pool, much larger than the default one, so
+ * that the free lists can grow to realistic lengths.
+ */
+#define BENCH_MIN_ORDER 12
+#define BENCH_MAX_ORDER 28
+
+#define BENCH_PAGE_SIZE (1 << BENCH_MIN_ORDER)
+#define BENCH_NUM_PAGES (1 << (BENCH_MAX_ORDER - BENCH_MIN_ORDER))
+
+/**
+ * A single benchmark workload
+ */
+typedef struct bench_t {
+	const char* name;        ///< Name used to select the workload
+	const char* description; ///< One line summary printed by -l
+	void (*run)(void);       ///< Runs the workload and prints its results
+	void (*setup)(void);     ///< Standard workloads: fills the pool before op runs, may be NULL
+	void (*op)(long i);      ///< Standard workloads: performs operation i, see run_standard
+} bench_t;
+
+
+#define BENCH_OPS 2000000
+#define BENCH_SLOTS 4096
+
+#define RSS_ARENA (4UL << 30)    // reserved by the rss workload
+#define RSS_LIVE (512UL << 20)   // touched by the rss workload
+#define RSS_BLOCK (64UL << 10)
+
+#define THREAD_OPS 1000000        // alloc or free calls per thread
+#define THREAD_WINDOW 64          // live blocks per thread
+#define THREAD_MAX 16
+#define THREAD_CACHE_ORDER 15     // cache blocks up to 32K
+
+#define SMALL_ARENA (64UL << 20)  // pool of the small workload
+#define SMALL_FILL_SIZE 100
+
+#define GROW_BUFFERS 64           // buffers grown side by side
+#define GROW_START 4096
+#define GROW_END (256 << 10)
+#define GROW_ROUNDS 100
+
+#define BULK_BATCH 32             // blocks per request of the bulk workload
+#define BULK_ROUNDS 50000
+
+#define CHURN_WINDOW 16           // live blocks of the churn workload
+#define CHURN_HIGH_WATERMARK 64
+
+#define FIT_MIN (64 << 10)        // request sizes of the fit workload
+#define FIT_MAX (1 << 20)
+
+#define META_ARENA (16UL << 30)   // pool of the metadata workload
+#define META_BLOCKS (META_ARENA >> BENCH_MIN_ORDER) // 4K blocks freed in random order
+
+#define CREATE_MIN_SHIFT 30       // pool sizes of the create workload, 1G...
+#define CREATE_MAX_SHIFT 40       // ...to 1T
+
+#define STATS_CALLS 1000000       // buddy_pool_get_stats calls timed
+
+#define SUITE_SEED 88172645463325252UL // both passes of a standard workload replay the same operations
+#define SUITE_WINDOW 64           // live blocks of the lifo and fifo workloads
+#define SAWTOOTH_FILL 4096        // blocks allocated before each drain
+#define STEADY_FILL 0.75          // share of the arena kept live by the steady workload
+
+
+static buddy_pool_t* pool;          // Pool of the running workload
+static void* pages[BENCH_NUM_PAGES]; // Blocks handed out by the workloads
+static unsigned long rng_state = 88172645463325252UL; // xorshift64 state
+
+static long live;                   // Blocks held by the running standard workload
+static long oldest;                 // Slot of the oldest block of the fifo workload
+static long failed;                 // Failed allocations of the running standard workload
+static FILE* results;               // Results file given with -o, NULL if none
+static const char* results_tag = ""; // Label of this run in the results file
+
+
+/**
+ * Read a monotonic clock
+ *
+ * @return Current time in nanoseconds
+ */
+static double now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Deterministic pseudo random numbers so runs are comparable
+ *
+ * @return Next value of a xorshift64 generator
+ */
+static unsigned long next_random()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/**
+ * Create the pool for a workload, exiting if that is not possible
+ */
+static void create_pool()
+{
+	pool = buddy_pool_create(1UL << BENCH_MAX_ORDER, BENCH_MIN_ORDER);
+
+	if (pool == NULL) {
+		fprintf(stderr, "ERROR: Failed to create a %d bit pool\n", BENCH_MAX_ORDER);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Read the resident set size of the process
+ *
+ * @return Resident memory in MiB
+ */
+static double rss_mib()
+{
+	FILE* statm = fopen("/proc/self/statm", "r");
+	unsigned long size = 0, resident = 0;
+
+	if (statm != NULL) {
+		if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+
+	return resident * (double) sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+/**
+ * Measure free latency against the length of the order-0 free list.
+ *
+ * Every page of the arena is allocated, then the even pages are freed one by
+ * one. Their buddies stay allocated so nothing coalesces and the smallest free
+ * list grows by one block per free. The average cost of a free is reported for
+ * each doubling of the list length.
+ */
+static void bench_free_scan()
+{
+	int next_report = 1024;
+	int last_report = 0;
+	double start;
+
+	create_pool();
+
+	for (int i = 0; i < BENCH_NUM_PAGES; ++i) {
+		pages[i] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE);
+
+		if (pages[i] == NULL) {
+			fprintf(stderr, "free-scan: arena exhausted after %d pages\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("%12s %12s\n", "list length", "ns/free");
+
+	start = now_ns();
+	for (int i = 0; i < BENCH_NUM_PAGES / 2; ++i) {
+		buddy_pool_free(pool, pages[2 * i]);
+
+		if (i + 1 == next_report) {
+			double end = now_ns();
+
+			printf("%12d %12.1f\n", i + 1, (end - start) / (next_report - last_report));
+			last_report = next_report;
+			next_report *= 2;
+			start = now_ns();
+		}
+	}
+
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Measure alloc/free cost with random sizes.
+ *
+ * A pool of slots is kept half full with blocks between 1 byte and 1M. Each
+ * step frees a random slot and refills it with a new random size, so requests
+ * of every order are served from a fragmented arena.
+ */
+static void bench_alloc_sizes()
+{
+	double start, end;
+	int failed = 0;
+
+	create_pool();
+	memset(pages, 0, sizeof(void*) * BENCH_SLOTS);
+
+	start = now_ns();
+	for (int i = 0; i < BENCH_OPS; ++i) {
+		int slot = next_random() % BENCH_SLOTS;
+		int size = 1 + next_random() % (1 << (next_random() % 21));
+
+		if (pages[slot] != NULL) {
+			buddy_pool_free(pool, pages[slot]);
+			pages[slot] = NULL;
+		}
+		else if ((pages[slot] = buddy_pool_alloc(pool, size)) == NULL) {
+			++failed;
+		}
+	}
+	end = now_ns();
+
+	printf("%d ops, %d failed allocations, %.1f ns/op\n", BENCH_OPS, failed,
+	       (end - start) / BENCH_OPS);
+
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Report RSS for a large reservation with and without page release.
+ *
+ * A 4G pool is reserved and 512M of 64K blocks are allocated and written,
+ * then everything is freed. Without a release order the memory stays
+ * resident; with one, coalescing into 2M blocks hands it back to the OS.
+ */
+static void bench_rss()
+{
+	static void* blocks[RSS_LIVE / RSS_BLOCK];
+	const int num_blocks = RSS_LIVE / RSS_BLOCK;
+	const int release_orders[] = { 0, 21 };
+
+	printf("%14s %12s %12s %12s\n", "release order", "reserved", "live", "freed");
+
+	for (int r = 0; r < 2; ++r) {
+		buddy_pool_config_t config;
+		double reserved, live;
+
+		buddy_pool_config_init(&config, RSS_ARENA, BENCH_MIN_ORDER);
+		config.release_order = release_orders[r];
+
+		if ((pool = buddy_pool_create_config(&config)) == NULL) {
+			fprintf(stderr, "ERROR: Failed to reserve the rss pool\n");
+			exit(EXIT_FAILURE);
+		}
+
+		reserved = rss_mib();
+
+		for (int i = 0; i < num_blocks; ++i) {
+			blocks[i] = buddy_pool_alloc(pool, RSS_BLOCK);
+			memset(blocks[i], 0xa5, RSS_BLOCK);
+		}
+
+		live = rss_mib();
+
+		for (int i = 0; i < num_blocks; ++i)
+			buddy_pool_free(pool, blocks[i]);
+
+		printf("%14d %10.1fM %10.1fM %10.1fM\n", release_orders[r], reserved,
+		       live, rss_mib());
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Body of a threads workload thread: alloc/free of 4K-32K blocks, keeping a
+ * small window of them live.
+ *
+ * @param arg Seed for the thread's random numbers
+ * @return NULL
+ */
+static void* thread_churn(void* arg)
+{
+	void* window[THREAD_WINDOW] = { NULL };
+	unsigned long state = (unsigned long) arg;
+
+	for (int i = 0; i < THREAD_OPS; ++i) {
+		int slot;
+
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		slot = state % THREAD_WINDOW;
+
+		if (window[slot] != NULL) {
+			buddy_pool_free(pool, window[slot]);
+			window[slot] = NULL;
+		}
+		else {
+			window[slot] = buddy_pool_alloc(pool, 4096 << ((state >> 8) % 4));
+		}
+	}
+
+	for (int i = 0; i < THREAD_WINDOW; ++i)
+		buddy_pool_free(pool, window[i]);
+
+	return NULL;
+}
+
+/**
+ * Measure throughput of 1 to 16 threads sharing a pool, with only the pool
+ * lock and with per-thread caches in front of it.
+ */
+static void bench_threads()
+{
+	pthread_t threads[THREAD_MAX];
+
+	printf("%8s %16s %16s\n", "threads", "locked Mops/s", "cached Mops/s");
+
+	for (int n = 1; n <= THREAD_MAX; n *= 2) {
+		double mops[2];
+
+		for (int cached = 0; cached < 2; ++cached) {
+			buddy_pool_config_t config;
+			double start;
+
+			buddy_pool_config_init(&config, 1UL << BENCH_MAX_ORDER, BENCH_MIN_ORDER);
+			config.cache_max_order = cached ? THREAD_CACHE_ORDER : 0;
+
+			if ((pool = buddy_pool_create_config(&config)) == NULL) {
+				fprintf(stderr, "ERROR: Failed to create the threads pool\n");
+				exit(EXIT_FAILURE);
+			}
+
+			start = now_ns();
+			for (int t = 0; t < n; ++t)
+				pthread_create(&threads[t], NULL, thread_churn,
+				               (void*)((t + 1) * 2654435761UL));
+			for (int t = 0; t < n; ++t)
+				pthread_join(threads[t], NULL);
+			mops[cached] = (double) n * THREAD_OPS / (now_ns() - start) * 1e3;
+
+			buddy_pool_destroy(pool);
+		}
+
+		printf("%8d %16.2f %16.2f\n", n, mops[0], mops[1]);
+	}
+}
+
+/**
+ * Compare small allocations with and without slabs.
+ *
+ * Reports how many 100 byte objects fit in a 64M pool, then the cost of
+ * alloc/free churn with random sizes between 1 and 2048 bytes.
+ */
+static void bench_small()
+{
+	static void* objects[SMALL_ARENA / 16];
+
+	printf("%8s %16s %12s\n", "slab", "100B objects", "ns/op");
+
+	for (int slab = 0; slab < 2; ++slab) {
+		buddy_pool_config_t config;
+		long filled = 0, capacity;
+		double start, end;
+
+		buddy_pool_config_init(&config, SMALL_ARENA, BENCH_MIN_ORDER);
+		config.slab = slab;
+
+		if ((pool = buddy_pool_create_config(&config)) == NULL) {
+			fprintf(stderr, "ERROR: Failed to create the small pool\n");
+			exit(EXIT_FAILURE);
+		}
+
+		while ((objects[filled] = buddy_pool_alloc(pool, SMALL_FILL_SIZE)) != NULL)
+			++filled;
+		capacity = filled;
+		while (filled > 0)
+			buddy_pool_free(pool, objects[--filled]);
+
+		memset(pages, 0, sizeof(void*) * BENCH_SLOTS);
+		start = now_ns();
+		for (int i = 0; i < BENCH_OPS; ++i) {
+			int slot = next_random() % BENCH_SLOTS;
+
+			if (pages[slot] != NULL) {
+				buddy_pool_free(pool, pages[slot]);
+				pages[slot] = NULL;
+			}
+			else {
+				pages[slot] = buddy_pool_alloc(pool, 1 + next_random() % 2048);
+			}
+		}
+		end = now_ns();
+
+		printf("%8s %16ld %12.1f\n", slab ? "on" : "off", capacity,
+		       (end - start) / BENCH_OPS);
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Grow message buffers from 4K to 256K, doubling at every step, with
+ * buddy_pool_realloc and with alloc + memcpy + free. Every step writes the new
+ * half so in-place growth is not credited for memory it never touches. Runs
+ * with a single buffer and with 64 buffers growing side by side, which
+ * leaves most buffers without a free buddy.
+ */
+static void bench_grow()
+{
+	const int live[] = { 1, GROW_BUFFERS };
+
+	printf("%8s %10s %12s %12s\n", "buffers", "method", "in place", "us/buffer");
+
+	for (int l = 0; l < 2; ++l) {
+		for (int use_realloc = 0; use_realloc < 2; ++use_realloc) {
+			long in_place = 0, steps = 0;
+			double start;
+
+			create_pool();
+
+			start = now_ns();
+			for (int round = 0; round < GROW_ROUNDS; ++round) {
+				for (int b = 0; b < live[l]; ++b) {
+					pages[b] = buddy_pool_alloc(pool, GROW_START);
+					memset(pages[b], b, GROW_START);
+				}
+
+				for (size_t size = GROW_START; size < GROW_END; size *= 2) {
+					for (int b = 0; b < live[l]; ++b) {
+						void* grown;
+
+						if (use_realloc) {
+							grown = buddy_pool_realloc(pool, pages[b], 2 * size);
+						}
+						else {
+							grown = buddy_pool_alloc(pool, 2 * size);
+							memcpy(grown, pages[b], size);
+							buddy_pool_free(pool, pages[b]);
+						}
+
+						in_place += grown == pages[b];
+						++steps;
+						pages[b] = grown;
+						memset((char*) grown + size, b, size);
+					}
+				}
+
+				for (int b = 0; b < live[l]; ++b)
+					buddy_pool_free(pool, pages[b]);
+			}
+
+			printf("%8d %10s %11.1f%% %12.1f\n", live[l],
+			       use_realloc ? "realloc" : "copy", 100.0 * in_place / steps,
+			       (now_ns() - start) / 1e3 / (GROW_ROUNDS * live[l]));
+
+			buddy_pool_destroy(pool);
+		}
+	}
+}
+
+/**
+ * Allocate and release batches of 32 4K blocks, one call per block and with
+ * the bulk calls. A few long lived blocks keep the arena fragmented.
+ */
+static void bench_bulk()
+{
+	void* batch[BULK_BATCH];
+
+	printf("%8s %14s\n", "method", "ns/block");
+
+	for (int bulk = 0; bulk < 2; ++bulk) {
+		double start;
+
+		create_pool();
+		for (int i = 0; i < BENCH_SLOTS; ++i)
+			pages[i] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE << (next_random() % 4));
+		for (int i = 0; i < BENCH_SLOTS; i += 2)
+			buddy_pool_free(pool, pages[i]);
+
+		start = now_ns();
+		for (int round = 0; round < BULK_ROUNDS; ++round) {
+			if (bulk) {
+				buddy_pool_alloc_bulk(pool, BENCH_PAGE_SIZE, BULK_BATCH, batch);
+				buddy_pool_free_bulk(pool, batch, BULK_BATCH);
+			}
+			else {
+				for (int i = 0; i < BULK_BATCH; ++i)
+					batch[i] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE);
+				for (int i = 0; i < BULK_BATCH; ++i)
+					buddy_pool_free(pool, batch[i]);
+			}
+		}
+
+		printf("%8s %14.1f\n", bulk ? "bulk" : "single",
+		       (now_ns() - start) / ((double) BULK_ROUNDS * BULK_BATCH));
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Compare eager and lazy coalescing on alloc/free churn of 4K-32K blocks,
+ * counting the splits and merges each mode performs.
+ */
+static void bench_churn()
+{
+	printf("%8s %12s %12s %12s\n", "mode", "splits/op", "merges/op", "ns/op");
+
+	for (int lazy = 0; lazy < 2; ++lazy) {
+		buddy_pool_config_t config;
+		struct buddy_stats stats;
+		double start, end;
+
+		buddy_pool_config_init(&config, 1UL << BENCH_MAX_ORDER, BENCH_MIN_ORDER);
+		config.lazy_high_watermark = lazy ? CHURN_HIGH_WATERMARK : 0;
+
+		if ((pool = buddy_pool_create_config(&config)) == NULL) {
+			fprintf(stderr, "ERROR: Failed to create the churn pool\n");
+			exit(EXIT_FAILURE);
+		}
+
+		memset(pages, 0, sizeof(void*) * CHURN_WINDOW);
+		start = now_ns();
+		for (int i = 0; i < BENCH_OPS; ++i) {
+			int slot = next_random() % CHURN_WINDOW;
+
+			if (pages[slot] != NULL) {
+				buddy_pool_free(pool, pages[slot]);
+				pages[slot] = NULL;
+			}
+			else {
+				pages[slot] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE << (next_random() % 4));
+			}
+		}
+		end = now_ns();
+
+		buddy_pool_get_stats(pool, &stats);
+		printf("%8s %12.3f %12.3f %12.1f\n", lazy ? "lazy" : "eager",
+		       (double) stats.splits / BENCH_OPS, (double) stats.merges / BENCH_OPS,
+		       (end - start) / BENCH_OPS);
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Fill a pool with large buffers of random, mostly non power of two sizes
+ * until the first allocation fails, with and without exact fit.
+ */
+static void bench_fit()
+{
+	printf("%10s %10s %14s %10s\n", "exact fit", "buffers", "requested", "used");
+
+	for (int exact = 0; exact < 2; ++exact) {
+		buddy_pool_config_t config;
+		unsigned long requested = 0;
+		int count = 0;
+
+		buddy_pool_config_init(&config, 1UL << BENCH_MAX_ORDER, BENCH_MIN_ORDER);
+		config.exact_fit = exact;
+
+		if ((pool = buddy_pool_create_config(&config)) == NULL) {
+			fprintf(stderr, "ERROR: Failed to create the fit pool\n");
+			exit(EXIT_FAILURE);
+		}
+
+		rng_state = 88172645463325252UL;
+		for (;;) {
+			size_t size = FIT_MIN + next_random() % (FIT_MAX - FIT_MIN);
+
+			if (buddy_pool_alloc(pool, size) == NULL)
+				break;
+			requested += size;
+			++count;
+		}
+
+		printf("%10s %10d %13.1fM %9.1f%%\n", exact ? "on" : "off", count,
+		       requested / (double)(1 << 20),
+		       100.0 * requested / (1UL << BENCH_MAX_ORDER));
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Report the memory taken by page metadata and the cost of freeing when the
+ * buddies being checked are spread all over it.
+ *
+ * A 16G pool is allocated as 4K blocks which are then freed in random order,
+ * so nearly every free merges with a buddy whose metadata is nowhere near the
+ * last one touched. The arena itself is never written.
+ */
+static void bench_metadata()
+{
+	void** blocks = malloc(META_BLOCKS * sizeof(void*));
+	buddy_pool_config_t config;
+	double before, start, end;
+
+	if (blocks == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate the metadata workload\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(blocks, 0xff, META_BLOCKS * sizeof(void*));
+	buddy_pool_config_init(&config, META_ARENA, BENCH_MIN_ORDER);
+	before = rss_mib();
+
+	if ((pool = buddy_pool_create_config(&config)) == NULL) {
+		fprintf(stderr, "ERROR: Failed to create the metadata pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%12s %12s %12s\n", "pages", "metadata", "ns/free");
+
+	for (unsigned long i = 0; i < META_BLOCKS; ++i)
+		blocks[i] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE);
+
+	rng_state = 88172645463325252UL;
+	for (int i = META_BLOCKS - 1; i > 0; --i) {
+		int j = next_random() % (i + 1);
+		void* tmp = blocks[i];
+
+		blocks[i] = blocks[j];
+		blocks[j] = tmp;
+	}
+
+	start = now_ns();
+	for (unsigned long i = 0; i < META_BLOCKS; ++i)
+		buddy_pool_free(pool, blocks[i]);
+	end = now_ns();
+
+	printf("%12lu %11.1fM %12.1f\n", META_BLOCKS,
+	       rss_mib() - before, (end - start) / META_BLOCKS);
+
+	buddy_pool_destroy(pool);
+	free(blocks);
+}
+
+/**
+ * Time pool creation and the first allocation for pools of 1G to 1T, and
+ * report how much memory a freshly created pool has made resident.
+ */
+static void bench_create()
+{
+	printf("%10s %12s %12s %12s\n", "pool", "create us", "alloc us", "resident");
+
+	for (int shift = CREATE_MIN_SHIFT; shift <= CREATE_MAX_SHIFT; shift += 5) {
+		double before = rss_mib();
+		double start, created, allocated;
+
+		start = now_ns();
+		pool = buddy_pool_create(1UL << shift, BENCH_MIN_ORDER);
+		created = now_ns();
+
+		if (pool == NULL) {
+			printf("%9luG %12s\n", 1UL << (shift - 30), "failed");
+			continue;
+		}
+
+		buddy_pool_alloc(pool, BENCH_PAGE_SIZE);
+		allocated = now_ns();
+
+		printf("%9luG %12.1f %12.1f %11.1fM\n", 1UL << (shift - 30),
+		       (created - start) / 1000, (allocated - created) / 1000,
+		       rss_mib() - before);
+
+		buddy_pool_destroy(pool);
+	}
+}
+
+/**
+ * Time buddy_pool_get_stats on a pool whose smallest free list holds every
+ * other page of the arena.
+ */
+static void bench_stats()
+{
+	struct buddy_stats stats;
+	double start, end;
+
+	create_pool();
+
+	for (int i = 0; i < BENCH_NUM_PAGES; ++i)
+		pages[i] = buddy_pool_alloc(pool, BENCH_PAGE_SIZE);
+	for (int i = 0; i < BENCH_NUM_PAGES; i += 2)
+		buddy_pool_free(pool, pages[i]);
+
+	start = now_ns();
+	for (int i = 0; i < STATS_CALLS; ++i)
+		buddy_pool_get_stats(pool, &stats);
+	end = now_ns();
+
+	printf("%12s %12s %12s\n", "free blocks", "used", "ns/call");
+	printf("%12lu %11.1fM %12.1f\n", stats.free_blocks[BENCH_MIN_ORDER],
+	       stats.bytes_used / (double)(1 << 20), (end - start) / STATS_CALLS);
+
+	buddy_pool_destroy(pool);
+}
+
+
+/**
+ * Allocate a block for a standard workload, counting failures
+ *
+ * @param size Bytes requested
+ * @return The block, NULL if the pool is out of memory
+ */
+static void* suite_alloc(size_t size)
+{
+	void* block = buddy_pool_alloc(pool, size);
+
+	if (block == NULL)
+		++failed;
+	return block;
+}
+
+/**
+ * Random request size of the standard workloads, log-uniform from 1 byte to
+ * 64K so that every order sees traffic
+ */
+static size_t suite_size()
+{
+	return 1 + next_random() % (1UL << (next_random() % 17));
+}
+
+/**
+ * Allocate a window of blocks, then free them newest first.
+ *
+ * @param i Number of the operation
+ */
+static void op_lifo(long i)
+{
+	if (i / SUITE_WINDOW % 2 == 0)
+		pages[live++] = suite_alloc(suite_size());
+	else
+		buddy_pool_free(pool, pages[--live]);
+}
+
+/**
+ * Keep a window of blocks, freeing the oldest before each new allocation.
+ *
+ * @param i Number of the operation
+ */
+static void op_fifo(long i)
+{
+	(void)i;
+
+	if (live < SUITE_WINDOW) {
+		pages[(oldest + live++) % SUITE_WINDOW] = suite_alloc(suite_size());
+	}
+	else {
+		buddy_pool_free(pool, pages[oldest]);
+		oldest = (oldest + 1) % SUITE_WINDOW;
+		--live;
+	}
+}
+
+/**
+ * Free or refill random slots with random sizes.
+ *
+ * @param i Number of the operation
+ */
+static void op_random(long i)
+{
+	int slot = next_random() % BENCH_SLOTS;
+
+	(void)i;
+	if (pages[slot] != NULL) {
+		buddy_pool_free(pool, pages[slot]);
+		pages[slot] = NULL;
+	}
+	else {
+		pages[slot] = suite_alloc(suite_size());
+	}
+}
+
+/**
+ * Fill the pool with a run of blocks, then drain them oldest first.
+ *
+ * @param i Number of the operation
+ */
+static void op_sawtooth(long i)
+{
+	if (i / SAWTOOTH_FILL % 2 == 0) {
+		pages[live++] = suite_alloc(suite_size());
+	}
+	else {
+		buddy_pool_free(pool, pages[i % SAWTOOTH_FILL]);
+		--live;
+	}
+}
+
+/**
+ * Random slot churn with power of two sizes from 4K to 64K.
+ *
+ * @param i Number of the operation
+ */
+static void op_pow2(long i)
+{
+	int slot = next_random() % BENCH_SLOTS;
+
+	(void)i;
+	if (pages[slot] != NULL) {
+		buddy_pool_free(pool, pages[slot]);
+		pages[slot] = NULL;
+	}
+	else {
+		pages[slot] = suite_alloc(BENCH_PAGE_SIZE << (next_random() % 5));
+	}
+}
+
+/**
+ * The pow2 workload with every size moved just past the power of two below,
+ * so each request needs the same order but wastes almost half its block.
+ *
+ * @param i Number of the operation
+ */
+static void op_odd(long i)
+{
+	int slot = next_random() % BENCH_SLOTS;
+
+	(void)i;
+	if (pages[slot] != NULL) {
+		buddy_pool_free(pool, pages[slot]);
+		pages[slot] = NULL;
+	}
+	else {
+		pages[slot] = suite_alloc((BENCH_PAGE_SIZE << (next_random() % 5)) / 2 + 1);
+	}
+}
+
+/**
+ * Fill the arena to STEADY_FILL with blocks of 4K to 64K before the steady
+ * workload starts.
+ */
+static void fill_steady()
+{
+	size_t used = 0;
+
+	while (used < STEADY_FILL * (1UL << BENCH_MAX_ORDER)) {
+		size_t size = BENCH_PAGE_SIZE << (next_random() % 5);
+
+		if ((pages[live] = buddy_pool_alloc(pool, size)) == NULL)
+			break;
+		used += size;
+		++live;
+	}
+}
+
+/**
+ * Free a random live block, then allocate one of a random size, keeping a
+ * mostly full arena at its fragmentation steady state.
+ *
+ * @param i Number of the operation
+ */
+static void op_steady(long i)
+{
+	if (i % 2 == 0 && live > 0) {
+		long victim = next_random() % live;
+
+		buddy_pool_free(pool, pages[victim]);
+		pages[victim] = pages[--live];
+	}
+	else if (i % 2 == 1) {
+		if ((pages[live] = suite_alloc(BENCH_PAGE_SIZE << (next_random() % 5))) != NULL)
+			++live;
+	}
+}
+
+/**
+ * Create the pool of a standard workload and replay its setup, so that every
+ * pass starts from the same state
+ *
+ * @param setup Fills the pool before the timed operations, may be NULL
+ */
+static void begin_standard(void (*setup)(void))
+{
+	create_pool();
+	memset(pages, 0, sizeof(pages));
+	rng_state = SUITE_SEED;
+	live = 0;
+	oldest = 0;
+	failed = 0;
+
+	if (setup != NULL)
+		setup();
+}
+
+/**
+ * Estimate the cost of timing an operation on its own
+ *
+ * @return Smallest interval between two clock reads in nanoseconds
+ */
+static double timer_overhead()
+{
+	double least = 1e9;
+
+	for (int i = 0; i < 1000; ++i) {
+		double start = now_ns();
+		double elapsed = now_ns() - start;
+
+		if (elapsed < least)
+			least = elapsed;
+	}
+
+	return least;
+}
+
+/**
+ * Run a standard workload and report it, also to the results file.
+ *
+ * A first pass times the BENCH_OPS operations as a whole for the throughput.
+ * A second pass replays them timing each one, less the cost of the clock, for
+ * the latency percentiles, and the fragmentation left in the pool after it is
+ * reported: the external index 1 - largest free block / free bytes, and the
+ * share of allocated bytes that requests left unused.
+ *
+ * @param bench Workload to run
+ */
+static void run_standard(const bench_t* bench)
+{
+	struct buddy_histogram hist;
+	struct buddy_stats stats;
+	double start, end, overhead = timer_overhead();
+	double frag, waste;
+
+	begin_standard(bench->setup);
+	start = now_ns();
+	for (long i = 0; i < BENCH_OPS; ++i)
+		bench->op(i);
+	end = now_ns();
+	buddy_pool_destroy(pool);
+
+	memset(&hist, 0, sizeof(hist));
+	hist.ns_per_tick = 1;
+
+	begin_standard(bench->setup);
+	for (long i = 0; i < BENCH_OPS; ++i) {
+		double started = now_ns();
+		double elapsed;
+
+		bench->op(i);
+		elapsed = now_ns() - started - overhead;
+		buddy_histogram_add(&hist, elapsed > 0 ? elapsed : 0);
+	}
+	buddy_pool_get_stats(pool, &stats);
+	buddy_pool_destroy(pool);
+
+	frag = stats.bytes_free ? 1 - (double) stats.largest_free / stats.bytes_free : 0;
+	waste = stats.bytes_allocated ? 1 - (double) stats.bytes_requested / stats.bytes_allocated : 0;
+
+	printf("%12s %8s %8s %8s %8s %8s %8s %8s %8s\n", "ops/s", "p50 ns", "p90 ns", "p99 ns",
+	       "p99.9 ns", "max ns", "frag", "waste", "failed");
+	printf("%12.0f %8.0f %8.0f %8.0f %8.0f %8lu %8.3f %8.3f %8ld\n", BENCH_OPS / (end - start) * 1e9,
+	       buddy_histogram_percentile(&hist, 50), buddy_histogram_percentile(&hist, 90),
+	       buddy_histogram_percentile(&hist, 99), buddy_histogram_percentile(&hist, 99.9),
+	       (unsigned long) hist.max, frag, waste, failed);
+
+	if (results != NULL) {
+		char date[32];
+		time_t now = time(NULL);
+
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+		fprintf(results, "%s\t%s\t%s\t%d\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%lu\t%.4f\t%.4f\t%ld\n",
+		        date, results_tag, bench->name, BENCH_OPS, BENCH_OPS / (end - start) * 1e9,
+		        buddy_histogram_percentile(&hist, 50), buddy_histogram_percentile(&hist, 90),
+		        buddy_histogram_percentile(&hist, 99), buddy_histogram_percentile(&hist, 99.9),
+		        (unsigned long) hist.max, frag, waste, failed);
+		fflush(results);
+	}
+}
+
+
+static const bench_t benchmarks[] = {
+	{ "free-scan", "free latency as the smallest free list grows", bench_free_scan, NULL, NULL },
+	{ "alloc-sizes", "alloc/free of random sizes in a fragmented arena", bench_alloc_sizes, NULL, NULL },
+	{ "rss", "resident memory of a 4G reservation before and after free", bench_rss, NULL, NULL },
+	{ "threads", "throughput of 1-16 threads with and without thread caches", bench_threads, NULL, NULL },
+	{ "small", "sub-page allocations with and without slabs", bench_small, NULL, NULL },
+	{ "grow", "growing buffers with buddy_realloc and with copies", bench_grow, NULL, NULL },
+	{ "bulk", "batches of 4K blocks with single and bulk calls", bench_bulk, NULL, NULL },
+	{ "churn", "splits and merges of eager and lazy coalescing", bench_churn, NULL, NULL },
+	{ "fit", "capacity for odd sized buffers with and without exact fit", bench_fit, NULL, NULL },
+	{ "metadata", "page metadata size and random order free latency", bench_metadata, NULL, NULL },
+	{ "create", "pool creation time and footprint from 1G to 1T", bench_create, NULL, NULL },
+	{ "stats", "cost of reading the statistics of a fragmented pool", bench_stats, NULL, NULL },
+	{ "lifo", "standard: blocks freed newest first", NULL, NULL, op_lifo },
+	{ "fifo", "standard: blocks freed oldest first", NULL, NULL, op_fifo },
+	{ "random", "standard: random sizes in random slots", NULL, NULL, op_random },
+	{ "sawtooth", "standard: fill 4096 blocks then drain them", NULL, NULL, op_sawtooth },
+	{ "pow2", "standard: power of two sizes from 4K to 64K", NULL, NULL, op_pow2 },
+	{ "odd", "standard: sizes just past a power of two", NULL, NULL, op_odd },
+	{ "steady", "standard: churn in a 75% full arena", NULL, fill_steady, op_steady },
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  %s [-l] [-o filename] [-t tag] [workload...]\n", prog_name);
+	fprintf(out, "     -l - List the available workloads. With no workload\n");
+	fprintf(out, "          arguments every workload is run.\n");
+	fprintf(out, "     -o - Append a tab separated line per standard workload\n");
+	fprintf(out, "          to a results file, which gets a header when new.\n");
+	fprintf(out, "     -t - Label the lines of this run in the results file,\n");
+	fprintf(out, "          for instance with a commit.\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* results_name = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "lo:t:")) != -1) {
+		switch (opt) {
+		case 'l':
+			for (int i = 0; i < NUM_BENCHMARKS; ++i)
+				printf("%-16s %s\n", benchmarks[i].name, benchmarks[i].description);
+			return EXIT_SUCCESS;
+
+		case 'o':
+			results_name = optarg;
+			break;
+
+		case 't':
+			results_tag = optarg;
+			break;
+
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int j = optind; j < argc; ++j) {
+		bool found = false;
+
+		for (int i = 0; i < NUM_BENCHMARKS; ++i)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				found = true;
+
+		if (!found) {
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (results_name != NULL) {
+		if ((results = fopen(results_name, "a")) == NULL) {
+			perror("ERROR: Failed to open the results file");
+			return EXIT_FAILURE;
+		}
+		if (ftell(results) == 0)
+			fprintf(results, "date\ttag\tworkload\tops\tops_per_sec\tp50_ns\tp90_ns\tp99_ns"
+			        "\tp999_ns\tmax_ns\tfrag_index\twaste\tfailed\n");
+	}
+
+	for (int i = 0; i < NUM_BENCHMARKS; ++i) {
+		bool selected = optind == argc;
+
+		for (int j = optind; j < argc; ++j)
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				selected = true;
+
+		if (!selected)
+			continue;
+
+		printf("== %s: %s\n", benchmarks[i].name, benchmarks[i].description);
+		if (benchmarks[i].op != NULL)
+			run_standard(&benchmarks[i]);
+		else
+			benchmarks[i].run();
+		printf("\n");
+	}
+
+	if (results != NULL)
+		fclose(results);
+
+	return EXIT_SUCCESS;
+}
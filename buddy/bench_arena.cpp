@@ -0,0 +1,202 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "buddy.h"
+#include "buddy_arena.hpp"
+
+/*
+ * Checks BuddyArena instantiations of several shapes and both lock
+ * policies, then times page sized alloc/free pairs against buddy_pool_alloc.
+ * With the argument "check" only the checks are run, as make test does.
+ */
+
+#define PAIRS 10000000          // alloc/free pairs timed
+#define THREADS 4               // threads sharing the BuddyMutex arena
+#define THREAD_PAIRS 200000     // alloc/free pairs per thread
+
+
+static int failures; // Failed expectations
+
+/**
+ * Record an expectation, reporting it if it does not hold
+ */
+#define expect(cond) expect_at(cond, #cond, __LINE__)
+
+static void expect_at(bool cond, const char* text, int line)
+{
+	if (cond)
+		return;
+
+	printf("  FAILED line %d: %s\n", line, text);
+	++failures;
+}
+
+/**
+ * Deterministic pseudo random numbers so runs are comparable
+ */
+static unsigned long next_random(unsigned long& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+/**
+ * Fill an arena with blocks of random orders, check that they are aligned,
+ * sized and apart, then free them and check that the arena coalesced back
+ * into one block
+ */
+template <typename Arena>
+static void check_arena(Arena& arena, const char* name)
+{
+	std::vector<std::pair<char*, std::size_t>> blocks;
+	unsigned long state = 88172645463325252UL;
+	int failed = failures;
+	bool sound = true;
+
+	for (;;) {
+		std::size_t size = Arena::block_sizes[next_random(state) % (Arena::num_orders > 4 ? 4 : Arena::num_orders)];
+		char* block = static_cast<char*>(arena.allocate(size));
+
+		// top up with pages once the larger sizes run out
+		if (block == nullptr && (block = static_cast<char*>(arena.allocate(size = Arena::page_size))) == nullptr)
+			break;
+
+		sound &= reinterpret_cast<uintptr_t>(block) % size == 0;
+		sound &= arena.owns(block) && arena.usable_size(block) == size;
+		std::memset(block, static_cast<int>(blocks.size()), size);
+		blocks.emplace_back(block, size);
+	}
+
+	// each block still holds its own fill, so none of them overlap
+	for (std::size_t i = 0; i < blocks.size(); ++i)
+		for (std::size_t j = 0; j < blocks[i].second; j += Arena::page_size)
+			sound &= blocks[i].first[j] == static_cast<char>(i);
+
+	expect(sound);
+	expect(!blocks.empty());
+	expect(arena.allocate(Arena::page_size) == nullptr);
+	expect(arena.allocate(Arena::arena_size + 1) == nullptr);
+
+	for (std::size_t i = 0; i < blocks.size(); i += 2)
+		arena.deallocate(blocks[i].first);
+	for (std::size_t i = 1; i < blocks.size(); i += 2)
+		arena.deallocate(blocks[i].first);
+	arena.deallocate(nullptr);
+
+	expect(arena.free_blocks(Arena::max_order) == 1);
+	for (int o = Arena::min_order; o < Arena::max_order; ++o)
+		expect(arena.free_blocks(o) == 0);
+
+	// orders resolved at compile time match the ones found at run time
+	void* page = arena.template allocate<1>();
+	void* whole = arena.template allocate<Arena::arena_size / 2 + 1>();
+	expect(page != nullptr && arena.usable_size(page) == Arena::page_size);
+	expect(whole == nullptr);
+	arena.deallocate(page);
+	expect(arena.free_blocks(Arena::max_order) == 1);
+
+	printf("%-32s %s\n", name, failures == failed ? "passed" : "FAILED");
+}
+
+/**
+ * Threads allocating and freeing pages of an arena shared through
+ * BuddyMutex, which must end up whole again
+ */
+template <typename Arena>
+static void check_threads(Arena& arena, const char* name)
+{
+	std::vector<std::thread> threads;
+	int failed = failures;
+
+	for (int t = 0; t < THREADS; ++t)
+		threads.emplace_back([&arena, t] {
+			void* window[16] = {};
+
+			for (int i = 0; i < THREAD_PAIRS; ++i) {
+				void*& slot = window[i % 16];
+
+				arena.deallocate(slot);
+				if ((slot = arena.allocate(Arena::page_size << (i % 3))) != nullptr)
+					*static_cast<int*>(slot) = t;
+			}
+			for (void* block : window)
+				arena.deallocate(block);
+		});
+	for (std::thread& thread : threads)
+		thread.join();
+
+	expect(arena.free_blocks(Arena::max_order) == 1);
+	printf("%-32s %s\n", name, failures == failed ? "passed" : "FAILED");
+}
+
+/**
+ * Time alloc/free pairs of a page
+ *
+ * @return Nanoseconds per pair
+ */
+template <typename Alloc, typename Free>
+static double time_pairs(Alloc alloc, Free release)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (long i = 0; i < PAIRS; ++i) {
+		void* block = alloc();
+
+		asm volatile("" : : "r"(block) : "memory");
+		release(block);
+	}
+
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / PAIRS;
+}
+
+
+int main(int argc, char** argv)
+{
+	bool timed = argc == 1;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "check") != 0)) {
+		fprintf(stderr, "Usage:\n  %s [check]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	{
+		BuddyArena<12, 20> arena;
+		check_arena(arena, "BuddyArena<12, 20>");
+	}
+	{
+		static char buffer[1 << 12] __attribute__((aligned(1 << 12)));
+		BuddyArena<4, 12> arena(buffer);
+		check_arena(arena, "BuddyArena<4, 12> in a buffer");
+	}
+	{
+		auto arena = std::make_unique<BuddyArena<14, 26, BuddyMutex>>();
+		check_arena(*arena, "BuddyArena<14, 26, BuddyMutex>");
+		check_threads(*arena, "  shared by threads");
+	}
+
+	if (timed && failures == 0) {
+		auto arena = std::make_unique<BuddyArena<12, 28>>();
+		auto locked = std::make_unique<BuddyArena<12, 28, BuddyMutex>>();
+		buddy_pool_t* pool = buddy_pool_create(1UL << 28, 12);
+
+		printf("\n%-28s %10s\n", "4K alloc/free pair", "ns");
+		printf("%-28s %10.1f\n", "BuddyArena<12, 28>",
+		       time_pairs([&] { return arena->allocate<4096>(); }, [&](void* b) { arena->deallocate(b); }));
+		printf("%-28s %10.1f\n", "BuddyArena<12, 28, Mutex>",
+		       time_pairs([&] { return locked->allocate<4096>(); }, [&](void* b) { locked->deallocate(b); }));
+		printf("%-28s %10.1f\n", "buddy_pool_alloc",
+		       time_pairs([&] { return buddy_pool_alloc(pool, 4096); }, [&](void* b) { buddy_pool_free(pool, b); }));
+
+		buddy_pool_destroy(pool);
+	}
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,248 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "buddy.hpp"
+
+/*
+ * Container heavy workloads run against the default allocator, std::pmr
+ * containers over new/delete and over a buddy pool, and BuddyAllocator.
+ * Every workload replays the same operations whatever allocates its memory.
+ */
+
+#define ARENA_SIZE (1UL << 32)   // pool the buddy allocators draw from
+#define VECTORS 20000            // vectors grown by push_back
+#define VECTOR_MAX 2000          // largest vector, in elements
+#define MAP_KEYS 200000          // keys inserted into the maps
+#define MAP_ROUNDS 5
+#define LIST_OPS 2000000         // pushes and pops of the list churn
+#define LIST_WINDOW 1000         // elements kept in the list
+#define DEQUE_OPS 4000000        // pushes and pops of the deque queue
+
+
+/**
+ * A container workload, one instance per allocator
+ */
+template <typename Alloc>
+struct workload {
+	template <typename T>
+	using rebind = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+	/**
+	 * Deterministic pseudo random numbers so runs are comparable
+	 */
+	static unsigned long next_random(unsigned long& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	/**
+	 * Grow vectors of random length one element at a time, keeping a
+	 * window of them alive
+	 */
+	static long vectors(const Alloc& alloc)
+	{
+		using vector_t = std::vector<long, rebind<long>>;
+		std::vector<vector_t> live;
+		unsigned long state = 88172645463325252UL;
+		long ops = 0;
+
+		live.reserve(64);
+		for (int i = 0; i < VECTORS; ++i) {
+			vector_t vector{rebind<long>(alloc)};
+			long length = next_random(state) % VECTOR_MAX;
+
+			for (long j = 0; j < length; ++j)
+				vector.push_back(j);
+			ops += length;
+
+			if (live.size() == 64)
+				live[next_random(state) % 64] = std::move(vector);
+			else
+				live.push_back(std::move(vector));
+		}
+
+		return ops;
+	}
+
+	/**
+	 * Fill ordered and hashed maps with random keys, then erase them
+	 */
+	static long maps(const Alloc& alloc)
+	{
+		using pair_t = std::pair<const long, long>;
+		unsigned long state = 88172645463325252UL;
+		long ops = 0;
+
+		for (int round = 0; round < MAP_ROUNDS; ++round) {
+			std::map<long, long, std::less<long>, rebind<pair_t>> tree{rebind<pair_t>(alloc)};
+			std::unordered_map<long, long, std::hash<long>, std::equal_to<long>, rebind<pair_t>>
+				hash{rebind<pair_t>(alloc)};
+			std::vector<long> keys(MAP_KEYS);
+
+			for (long& key : keys) {
+				key = next_random(state);
+				tree.emplace(key, key);
+				hash.emplace(key, key);
+			}
+			for (long key : keys) {
+				tree.erase(key);
+				hash.erase(key);
+			}
+			ops += 4 * MAP_KEYS;
+		}
+
+		return ops;
+	}
+
+	/**
+	 * Append list nodes and drop the oldest, keeping the list at about
+	 * LIST_WINDOW nodes
+	 */
+	static long lists(const Alloc& alloc)
+	{
+		std::list<long, rebind<long>> list{rebind<long>(alloc)};
+		unsigned long state = 88172645463325252UL;
+
+		for (long i = 0; i < LIST_OPS; ++i) {
+			if (list.size() < LIST_WINDOW || next_random(state) % 2 == 0)
+				list.push_back(i);
+			if (list.size() > LIST_WINDOW)
+				list.pop_front();
+		}
+
+		return LIST_OPS;
+	}
+
+	/**
+	 * Run a deque as a queue, allocating and freeing its chunks
+	 */
+	static long deques(const Alloc& alloc)
+	{
+		std::deque<long, rebind<long>> queue{rebind<long>(alloc)};
+
+		for (long i = 0; i < DEQUE_OPS; ++i) {
+			queue.push_back(i);
+			if (queue.size() > 100000)
+				queue.pop_front();
+		}
+
+		return DEQUE_OPS;
+	}
+};
+
+/**
+ * A named workload
+ */
+struct bench_t {
+	const char* name; ///< Name used to select the workload
+	long (*run[4])(buddy_memory_resource&); ///< Workload against each allocator, see allocators
+};
+
+/**
+ * Allocators the workloads are run against
+ */
+static const char* allocators[4] = {"std", "pmr-new", "pmr-buddy", "BuddyAllocator"};
+
+/**
+ * Run a workload against each allocator
+ */
+template <long (*std_run)(const std::allocator<long>&),
+          long (*pmr_run)(const std::pmr::polymorphic_allocator<long>&),
+          long (*buddy_run)(const BuddyAllocator<long>&)>
+static constexpr bench_t make_bench(const char* name)
+{
+	return {name, {
+		[](buddy_memory_resource&) { return std_run(std::allocator<long>()); },
+		[](buddy_memory_resource&) {
+			return pmr_run(std::pmr::polymorphic_allocator<long>(std::pmr::new_delete_resource()));
+		},
+		[](buddy_memory_resource& resource) { return pmr_run(std::pmr::polymorphic_allocator<long>(&resource)); },
+		[](buddy_memory_resource& resource) { return buddy_run(BuddyAllocator<long>(&resource)); },
+	}};
+}
+
+#define BENCH(name) \
+	make_bench<workload<std::allocator<long>>::name, \
+	           workload<std::pmr::polymorphic_allocator<long>>::name, \
+	           workload<BuddyAllocator<long>>::name>(#name)
+
+static const bench_t benchmarks[] = {
+	BENCH(vectors),
+	BENCH(maps),
+	BENCH(lists),
+	BENCH(deques),
+};
+
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  ./%s [workload...]\n", prog_name);
+	fprintf(out, "     Runs the named workloads, or all of them: vectors, maps, lists, deques\n");
+}
+
+int main(int argc, char** argv)
+{
+	for (int j = 1; j < argc; ++j) {
+		bool found = false;
+
+		for (const bench_t& bench : benchmarks)
+			found |= strcmp(argv[j], bench.name) == 0;
+
+		if (!found) {
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%-10s %-16s %12s %10s %12s\n", "workload", "allocator", "ops", "ns/op", "pool MiB");
+
+	for (const bench_t& bench : benchmarks) {
+		bool selected = argc == 1;
+
+		for (int j = 1; j < argc; ++j)
+			selected |= strcmp(argv[j], bench.name) == 0;
+
+		if (!selected)
+			continue;
+
+		for (int i = 0; i < 4; ++i) {
+			// a fresh pool per run, so its peak use belongs to the run
+			buddy_memory_resource resource(ARENA_SIZE);
+			struct buddy_stats stats;
+
+			auto start = std::chrono::steady_clock::now();
+			long ops = bench.run[i](resource);
+			std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+			buddy_pool_get_stats(resource.pool(), &stats);
+
+			if (stats.peak_used != 0)
+				printf("%-10s %-16s %12ld %10.1f %12.2f\n", bench.name, allocators[i], ops,
+				       elapsed.count() / ops, stats.peak_used / (double) (1 << 20));
+			else
+				printf("%-10s %-16s %12ld %10.1f %12s\n", bench.name, allocators[i], ops,
+				       elapsed.count() / ops, "-");
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
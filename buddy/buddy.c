@@ -9,11 +9,40 @@
  **************************************************************************/
 #define USE_DEBUG 0
 
+/* serialize pools with a mutex and enable the per-thread block caches */
+#ifndef USE_THREADS
+#define USE_THREADS 1
+#endif
+
+/* record alloc/free calls in per-thread rings, see buddy_trace_enable */
+#ifndef USE_TRACE
+#define USE_TRACE 0
+#endif
+
+/* time alloc/free calls into per-thread histograms, see buddy_histogram_get */
+#ifndef USE_HISTOGRAM
+#define USE_HISTOGRAM 0
+#endif
+
 /**************************************************************************
  * Included Files
  **************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if USE_THREADS == 1 || USE_TRACE == 1 || USE_HISTOGRAM == 1
+#include <pthread.h>
+#endif
+#if USE_TRACE == 1 || USE_HISTOGRAM == 1
+#include <time.h>
+#endif
 
 #include "buddy.h"
 #include "list.h"
@@ -21,18 +50,69 @@
 /**************************************************************************
  * Public Definitions
  **************************************************************************/
+/* shape of the default pool used by buddy_init/alloc/free/dump */
+#ifndef MIN_ORDER
 #define MIN_ORDER 12 //2^12
+#endif
+#ifndef MAX_ORDER
 #define MAX_ORDER 20 //2^20
+#endif
+
+/* size classes of the slab layer: 16, 32, ..., 2048 bytes */
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 8
+#define SLAB_MAX_SIZE (1UL<<(SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+/* bytes reserved for the slab header at the start of every slab */
+#define SLAB_HEADER 64
+/* a slab spans as many pages as it takes to hold this many objects */
+#define SLAB_MIN_OBJECTS 4
+
+/* layout of a shared pool's segment and of a file pool's file: a
+ * shared_header_t, the pool at SHARED_POOL_OFFSET, its page metadata, then
+ * its arena on a page boundary */
+#define SHARED_MAGIC "BUDDYSHM"
+#define FILE_MAGIC "BUDDYMAP"
+#define SHARED_POOL_OFFSET 64
+#define SHARED_PAGE_SIZE 4096 // the arena starts on a boundary of at least this
+#define SEGMENT_META_OFFSET (SHARED_POOL_OFFSET + ((sizeof(buddy_pool_t) + 63) & ~63UL))
 
-#define PAGE_SIZE (1<<MIN_ORDER) // 2^12 = 4k
+/* arena and page metadata of a pool, see struct buddy_pool */
+#define POOL_MEMORY(pool) ((char *)((intptr_t)(pool) + (pool)->memory_offset))
+#define POOL_STATE(pool) ((unsigned char *)((intptr_t)(pool) + (pool)->state_offset))
+#define POOL_NEXT(pool) ((uint32_t *)((intptr_t)(pool) + (pool)->next_offset))
+#define POOL_PREV(pool) ((uint32_t *)((intptr_t)(pool) + (pool)->prev_offset))
+
+#define PAGE_SIZE(pool) (1UL<<(pool)->min_order) // 2^12 = 4k for the default pool
 /* page index to address */
-#define PAGE_TO_ADDR(page_idx) (void *)(((page_idx)*PAGE_SIZE) + g_memory) // returns pointer to location in g_mem
+#define PAGE_TO_ADDR(pool, page_idx) (void *)(((page_idx)*PAGE_SIZE(pool)) + POOL_MEMORY(pool)) // returns pointer to location in the arena
 
 /* address to page index */
-#define ADDR_TO_PAGE(addr) ((unsigned long)(((void *)(addr)) - (void *)g_memory) / PAGE_SIZE) //return what page address belongs to
+#define ADDR_TO_PAGE(pool, addr) ((unsigned long)((char *)(addr) - POOL_MEMORY(pool)) >> (pool)->min_order) //return what page address belongs to
+
+/* find the index of the buddy of a block of order o */
+#define BUDDY_PAGE(pool, page_idx, o) ((page_idx) ^ (1UL<<((o) - (pool)->min_order)))
+
+/* page state, one byte per page */
+#define PAGE_ORDER_MASK 0x3f // order of the block the page heads or belongs to
+#define PAGE_FREE 0x40       // the page heads a block sitting in free_area[order]
+#define PAGE_RELEASED 0x80   // on free blocks: the memory is given back to the OS
+#define PAGE_SLAB 0x80       // on allocated pages: the page belongs to a slab
+
+#define PAGE_ORDER(pool, page_idx) (POOL_STATE(pool)[page_idx] & PAGE_ORDER_MASK)
 
-/* find buddy address */
-#define BUDDY_ADDR(addr, o) (void *)((((unsigned long)(addr) - (unsigned long)g_memory) ^ (1<<(o))) + (unsigned long)g_memory) //pointer to addr's buddy
+/* bytes of metadata per page: two free list links and the state byte */
+#define PAGE_METADATA (2 * sizeof(uint32_t) + sizeof(unsigned char))
+
+/* end of a free list, also the bound on the number of pages of a pool */
+#define PAGE_NONE 0xffffffffU
+
+/* while a block is allocated its free list link holds the number of pages an
+ * exact fit allocation kept, 0 if it is the whole block */
+#define PAGE_KEPT(pool, page_idx) (POOL_NEXT(pool)[page_idx])
+
+/* and its prev link holds how many of the bytes it was granted the request
+ * left unused, saturated at PAGE_NONE */
+#define PAGE_SLACK(pool, page_idx) (POOL_PREV(pool)[page_idx])
 
 
 
@@ -47,193 +127,3089 @@
 #  define IFDEBUG(x)
 #endif
 
+/* counts the splits, merges and lock acquisitions of the calling thread.
+ * Histograms always need them, traces only while tracing is enabled. */
+#if USE_HISTOGRAM == 1
+#  define COUNT_OP(counter) (g_op_counts.counter++)
+#elif USE_TRACE == 1
+#  define COUNT_OP(counter) do { if (TRACING()) g_op_counts.counter++; } while (0)
+#else
+#  define COUNT_OP(counter)
+#endif
+
+/* the lock of a shared pool whose holder died comes back with EOWNERDEAD,
+ * and the free lists it may have left halfway through an update are rebuilt
+ * before the lock is made consistent again */
+#if USE_THREADS == 1
+#  define LOCK_POOL(pool) do { COUNT_OP(locks); \
+	if (pthread_mutex_lock(&(pool)->lock) == EOWNERDEAD) \
+	{ recoverPool(pool); pthread_mutex_consistent(&(pool)->lock); } } while (0)
+#  define UNLOCK_POOL(pool) pthread_mutex_unlock(&(pool)->lock)
+#else
+#  define LOCK_POOL(pool) COUNT_OP(locks)
+#  define UNLOCK_POOL(pool)
+#endif
+
+#if USE_TRACE == 1
+/* events each thread's ring holds, a power of two */
+#  ifndef TRACE_RING_SIZE
+#    define TRACE_RING_SIZE 4096
+#  endif
+#  define TRACING() __builtin_expect(__atomic_load_n(&g_trace_enabled, __ATOMIC_RELAXED), 0)
+#  define TRACE(type, addr, size, order) \
+	do { if (TRACING()) traceEvent(type, addr, size, order); } while (0)
+#  define TRACE_BATCH(pool, type, addrs, n, size) \
+	do { if (TRACING()) traceBatch(pool, type, addrs, n, size); } while (0)
+#else
+#  define TRACING() 0
+#  define TRACE(type, addr, size, order) do { if (0) (void)(order); } while (0)
+#  define TRACE_BATCH(pool, type, addrs, n, size)
+#endif
+
 
 /**************************************************************************
  * Public Types
  **************************************************************************/
+/**
+ * Header at the start of a slab. A slab is a buddy block carved into objects
+ * of one size class; its objects are handed out from the free_objects list
+ * first, then from the never used tail.
+ */
+typedef struct {
+	struct list_head list;  ///< entry in the class's partial list
+	void* free_objects;     ///< singly linked list of freed objects
+	size_t next_unused;     ///< offset of the first never used object
+	int size_class;
+	int in_use;
+	int capacity;
+} slab_t;
+
+/**
+ * An independent buddy heap. Pools share nothing, so fragmentation in one
+ * pool can never starve another.
+ */
+struct buddy_pool {
+	/* the arena and the page metadata, as offsets from the pool itself, so a
+	 * pool in shared memory works wherever each process maps it. See
+	 * POOL_MEMORY and friends. */
+	intptr_t memory_offset; ///< arena the blocks are carved from
+	intptr_t state_offset;  ///< order and PAGE_* flags of every page
+	intptr_t next_offset;   ///< free list links by page index, PAGE_NONE ends a list
+	intptr_t prev_offset;
+	size_t shared_length;   ///< bytes of the shared memory segment or file, 0 for private pools
+	int file_fd;            ///< open file of a file pool, locked while open, -1 for other pools
+	size_t root;            ///< offset of the root block plus one, 0 if there is none
+	unsigned long num_pages;
+	size_t size;            ///< bytes managed, a multiple of the page size
+	int min_order;
+	int max_order;          ///< order of the largest block that fits in size
+	int release_order;      ///< free blocks this large are released, 0 never
+	int release_advice;     ///< madvise() advice used to release memory
+	int cache_max_order;    ///< largest order kept in thread caches, -1 none
+	int cache_size;         ///< blocks per order a thread cache can hold
+	int slab;               ///< serve requests up to SLAB_MAX_SIZE from slabs
+	int slab_order[SLAB_CLASSES]; ///< block order of each class's slabs
+	int exact_fit;          ///< return the unused tail of allocated blocks
+	unsigned long lazy_high; ///< free blocks per order before coalescing, 0 eager
+	unsigned long lazy_low;  ///< free blocks per order a coalescing pass leaves
+
+#if USE_THREADS == 1
+	pthread_mutex_t lock;   ///< protects everything below
+	pthread_key_t cache_key;
+	struct list_head caches; ///< thread caches of this pool
+#endif
+
+	/* bit o is set while free_area[o] is not empty */
+	unsigned long free_mask;
+	/* first page of every free list and the lengths of the lists */
+	uint32_t free_area[BUDDY_MAX_ORDERS];
+	unsigned long free_count[BUDDY_MAX_ORDERS];
+	/* operation counters */
+	unsigned long nr_splits;
+	unsigned long nr_merges;
+	/* bytes off the free lists, now and at most */
+	unsigned long used;
+	unsigned long peak_used;
+	/* bytes granted to and requested by live allocations, the thread caches
+	 * keep their own share of these */
+	unsigned long allocated;
+	unsigned long requested;
+	/* slabs with free objects, per size class */
+	struct list_head slab_partial[SLAB_CLASSES];
+};
+
+/**
+ * Start of the segment of a shared pool or the file of a file pool, see
+ * buddy_pool_create_shared and buddy_pool_create_file
+ */
+typedef struct {
+	char magic[8];          ///< SHARED_MAGIC or FILE_MAGIC once the pool is ready
+	size_t length;          ///< bytes in the segment
+	size_t arena_offset;    ///< where the arena starts
+	int max_order;          ///< the arena is mapped aligned to its largest block
+	unsigned layout;        ///< sizeof(buddy_pool_t) of the build that made the pool
+	uint64_t generation;    ///< file pools: bumped every time the file is opened
+	uint64_t clean;         ///< file pools: the generation that was last closed cleanly
+} shared_header_t;
+
+/**
+ * Blocks a thread keeps for itself in front of the shared free lists. Cached
+ * blocks count as allocated as far as the pool is concerned, so they never
+ * coalesce until they are drained back.
+ */
+typedef struct {
+	struct list_head list;  ///< entry in the pool's caches list
+	buddy_pool_t* pool;
+	unsigned long allocated; ///< share of the pool's allocated bytes, may wrap
+	unsigned long requested;
+	int count[BUDDY_MAX_ORDERS];
+	uint32_t blocks[];      ///< cache_size page indices per cached order
+} thread_cache_t;
+
+#if USE_TRACE == 1 || USE_HISTOGRAM == 1
+/**
+ * Work done by a thread. The counters only ever grow, tracing and the
+ * histograms take differences.
+ */
 typedef struct {
-	struct list_head list;
+	unsigned long splits;   ///< blocks split
+	unsigned long merges;   ///< buddy pairs merged
+	unsigned long locks;    ///< pool lock acquisitions
+} op_counts_t;
+#endif
+
+#if USE_TRACE == 1
+/**
+ * Events of one thread. The thread is the only writer of head and drains are
+ * the only writers of tail, so neither side needs a lock.
+ */
+typedef struct {
+	struct list_head list;  ///< entry in g_trace_rings
+	unsigned long head;     ///< events ever written
+	unsigned long tail;     ///< events ever drained
+	unsigned long dropped;  ///< events lost to a full ring
+	unsigned long reported; ///< dropped events already reported by a drain
+	int thread;
+	int exited;             ///< set once the thread is gone and the ring can be freed
+	struct buddy_trace_event events[TRACE_RING_SIZE];
+} trace_ring_t;
 
-	int index;
-	char* address;
-	int order;
+/**
+ * Tracing state of a thread
+ */
+typedef struct {
+	trace_ring_t* ring;
+	unsigned long splits;   ///< splits of the thread at its last event
+	unsigned long merges;
+} trace_local_t;
+#endif
 
-} page_t;
+#if USE_HISTOGRAM == 1
+/**
+ * Histograms of one thread, each allocated by the thread when it first
+ * records into it. The thread is the only writer, readers load its counts
+ * while it runs.
+ */
+typedef struct {
+	struct list_head list;  ///< entry in g_hist_threads
+	struct buddy_histogram* hist[BUDDY_HIST_OPS][BUDDY_MAX_ORDERS][BUDDY_HIST_OUTCOMES];
+} hist_local_t;
+#endif
 
 /**************************************************************************
  * Global Variables
  **************************************************************************/
-/* free lists*/
-struct list_head free_area[MAX_ORDER+1];
-/* memory area */
-char g_memory[1<<MAX_ORDER]; // 2^20 bytes of memory
+/* pool behind buddy_init/alloc/free/dump */
+buddy_pool_t *g_default_pool;
+
+#if USE_TRACE == 1 || USE_HISTOGRAM == 1
+__thread op_counts_t g_op_counts;
+#endif
+
+#if USE_TRACE == 1
+int g_trace_enabled;
+__thread trace_local_t g_trace_local;
+/* rings of all threads, the lock also serializes drains */
+LIST_HEAD(g_trace_rings);
+pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+int g_trace_threads;
+/* marks the ring of an exiting thread */
+pthread_key_t g_trace_key;
+pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+#endif
 
-/* page structures */
-page_t g_pages[(1<<MAX_ORDER)/PAGE_SIZE];
+#if USE_HISTOGRAM == 1
+__thread hist_local_t* g_hist_local;
+/* histograms of running threads and the sums of those that exited, the lock
+ * also serializes readers */
+LIST_HEAD(g_hist_threads);
+hist_local_t g_hist_exited;
+pthread_mutex_t g_hist_lock = PTHREAD_MUTEX_INITIALIZER;
+/* folds the histograms of an exiting thread into g_hist_exited */
+pthread_key_t g_hist_key;
+pthread_once_t g_hist_once = PTHREAD_ONCE_INIT;
+/* time stamp and clock when the first histogram was created, used to measure
+ * the length of a tick */
+uint64_t g_hist_epoch_ticks;
+uint64_t g_hist_epoch_ns;
+#endif
 
 /**************************************************************************
  * Public Function Prototypes
  **************************************************************************/
+void recoverPool(buddy_pool_t* pool);
 
 /**************************************************************************
  * Local Functions
  **************************************************************************/
 
  //determines what order is needed given a size of memory
- int determineOrder(int size)
+ int determineOrder(buddy_pool_t* pool, size_t size)
  {
- 	for(int order=MIN_ORDER; order<=MAX_ORDER; order++)
+ 	if (size <= PAGE_SIZE(pool))
  	{
- 			if ((1<<order) >= size)
- 			{
- 				return order;
- 	 		}
+ 		return pool->min_order;
+ 	}
+
+ 	//ceil(log2(size)) from the position of the highest bit of size-1
+ 	int order = 64 - __builtin_clzl(size - 1);
+
+ 	return order <= pool->max_order ? order : -1;
+ }
+
+
+ //adds a block to the free list of the given order and tags it as free
+ void addFreeBlock(buddy_pool_t* pool, unsigned long page, int order, int released)
+ {
+ 	uint32_t head = pool->free_area[order];
+ 	uint32_t* next = POOL_NEXT(pool);
+ 	uint32_t* prev = POOL_PREV(pool);
+
+ 	POOL_STATE(pool)[page] = order | PAGE_FREE | (released ? PAGE_RELEASED : 0);
+ 	prev[page] = PAGE_NONE;
+ 	next[page] = head;
+ 	if (head != PAGE_NONE)
+ 	{
+ 		prev[head] = page;
+ 	}
+ 	pool->free_area[order] = page;
+ 	pool->free_count[order]++;
+ 	pool->free_mask |= 1UL << order;
+ }
+
+
+ //removes a block from its free list and clears its tags, the order is
+ //kept. Returns whether the block's memory was released.
+ int removeFreeBlock(buddy_pool_t* pool, unsigned long page)
+ {
+ 	unsigned char* state = POOL_STATE(pool);
+ 	uint32_t* nextLinks = POOL_NEXT(pool);
+ 	uint32_t* prevLinks = POOL_PREV(pool);
+ 	int order = state[page] & PAGE_ORDER_MASK;
+ 	int released = (state[page] & PAGE_RELEASED) != 0;
+ 	uint32_t next = nextLinks[page];
+ 	uint32_t prev = prevLinks[page];
+
+ 	state[page] = order;
+ 	if (prev != PAGE_NONE)
+ 	{
+ 		nextLinks[prev] = next;
+ 	}
+ 	else
+ 	{
+ 		pool->free_area[order] = next;
+ 	}
+ 	if (next != PAGE_NONE)
+ 	{
+ 		prevLinks[next] = prev;
+ 	}
+ 	pool->free_count[order]--;
+ 	if (pool->free_area[order] == PAGE_NONE)
+ 	{
+ 		pool->free_mask &= ~(1UL << order);
  	}
- 	return -1;
+ 	return released;
+ }
+
+
+ //checks in constant time whether page heads a free block of the given order
+ int isFreeBlock(buddy_pool_t* pool, unsigned long page, int order)
+ {
+ 	return (POOL_STATE(pool)[page] & ~PAGE_RELEASED) == (PAGE_FREE | order);
+ }
+
+
+ //returns the buddy of a block at the given order, or PAGE_NONE for blocks
+ //at the tail of a non power of two arena, which have no buddy
+ unsigned long buddyOf(buddy_pool_t* pool, unsigned long page, int order)
+ {
+ 	unsigned long buddy = BUDDY_PAGE(pool, page, order);
+
+ 	return buddy < pool->num_pages ? buddy : PAGE_NONE;
  }
 
 
- //recursive function to split memory into smaller blocks as needed
- void splitMemory(page_t* page, int order, int orderNeeded)
+ //recursive function to split memory into smaller blocks as needed, the
+ //split off halves stay released if the block they came from was
+ void splitMemory(buddy_pool_t* pool, unsigned long page, int order, int orderNeeded, int released)
  {
  	if(order == orderNeeded)
  	{
  		return;
  	}
 
- 	page_t* buddy = &g_pages[ADDR_TO_PAGE(BUDDY_ADDR(page->address,order-1))];
- 	buddy->order = order-1;
- 	list_add(&(buddy->list),&free_area[order-1]);//adds buddy to free area
- 	splitMemory(page,order-1,orderNeeded);
+ 	addFreeBlock(pool, BUDDY_PAGE(pool, page, order-1), order-1, released);//adds buddy to free area
+ 	pool->nr_splits++;
+ 	COUNT_OP(splits);
+ 	splitMemory(pool, page,order-1,orderNeeded, released);
  }
 
 
-/**
- * Initialize the buddy system
- */
-void buddy_init()
-{
-	int numPages = (1<<MAX_ORDER)/PAGE_SIZE;
+ //gives the physical pages of a block back to the OS, they are faulted back
+ //in lazily (and zero filled) the next time the block is touched
+ void releaseBlock(buddy_pool_t* pool, unsigned long page, int order)
+ {
+ 	if (madvise(PAGE_TO_ADDR(pool, page), 1UL<<order, pool->release_advice) != 0 &&
+ 	    pool->release_advice != MADV_DONTNEED)
+ 	{
+ 		//MADV_FREE is not supported everywhere
+ 		pool->release_advice = MADV_DONTNEED;
+ 		madvise(PAGE_TO_ADDR(pool, page), 1UL<<order, MADV_DONTNEED);
+ 	}
+ }
 
-	//Initialize g_pages
-	for (int i = 0; i < numPages; i++)
-	{
-		g_pages[i].index = i;
-		g_pages[i].address = PAGE_TO_ADDR(i);
-		g_pages[i].order = -1;
-	}
 
-	//initialize free_area
-	for (int i = MIN_ORDER; i <= MAX_ORDER; i++)
+ //merges the free blocks of one order whose buddies are free as well, until
+ //no more than keep blocks are left at that order. Merged blocks go to the
+ //next order, which may then need a pass of its own. The pool must be
+ //locked. Returns the number of merges.
+ unsigned long coalesceOrder(buddy_pool_t* pool, int order, unsigned long keep)
+ {
+ 	unsigned long pos = pool->free_area[order];
+ 	unsigned long merges = 0;
+
+ 	while (pos != PAGE_NONE && pool->free_count[order] > keep)
  	{
-		INIT_LIST_HEAD(&free_area[i]);
-	}
+ 		unsigned long page = pos;
+ 		unsigned long buddy = buddyOf(pool, page, order);
 
-	g_pages[0].order = MAX_ORDER;
+ 		pos = POOL_NEXT(pool)[pos];
+ 		if (buddy == PAGE_NONE || !isFreeBlock(pool, buddy, order))
+ 		{
+ 			continue;
+ 		}
+ 		if (pos == buddy)
+ 		{
+ 			pos = POOL_NEXT(pool)[pos];
+ 		}
 
-	// list the entire memory as free
-	list_add(&g_pages[0].list, &free_area[MAX_ORDER]);
-}
+ 		int pageReleased = removeFreeBlock(pool, page);
+ 		int buddyReleased = removeFreeBlock(pool, buddy);
 
-/**
- * Allocate a memory block.
- *
- * On a memory request, the allocator returns the head of a free-list of the
- * matching size (i.e., smallest block that satisfies the request). If the
- * free-list of the matching block size is empty, then a larger block size will
- * be selected. The selected (large) block is then splitted into two smaller
- * blocks. Among the two blocks, left block will be used for allocation or be
- * further splitted while the right block will be added to the appropriate
- * free-list.
- *
- * @param size size in bytes
- * @return memory block address
- */
-void *buddy_alloc(int size)
-{
-	int orderNeeded = determineOrder(size);
+ 		int released = pageReleased && buddyReleased;
+ 		if (pool->release_order > 0 && order + 1 >= pool->release_order && !released)
+ 		{
+ 			if (!pageReleased)
+ 			{
+ 				releaseBlock(pool, page, order);
+ 			}
+ 			if (!buddyReleased)
+ 			{
+ 				releaseBlock(pool, buddy, order);
+ 			}
+ 			released = 1;
+ 		}
 
-	if( orderNeeded == -1) //too big of a request
-	{
-		return NULL;
-	}
+ 		addFreeBlock(pool, buddy < page ? buddy : page, order + 1, released);
+ 		pool->nr_merges++;
+ 		COUNT_OP(merges);
+ 		merges++;
+ 	}
 
-	for (int i = orderNeeded; i<= MAX_ORDER; i++)
-	{
-		if(!list_empty(&free_area[i]))
-		{
-			page_t *page = list_entry(free_area[i].next,page_t,list);
-			list_del_init(&(page->list));
-			splitMemory(page, i, orderNeeded);
-			page->order = orderNeeded;
-			return page->address;
-		}
-	}
-	return NULL; //there was not enough memory available
-}
+ 	return merges;
+ }
 
-/**
- * Free an allocated memory block.
- *
- * Whenever a block is freed, the allocator checks its buddy. If the buddy is
- * free as well, then the two buddies are combined to form a bigger block. This
- * process continues until one of the buddies is not free.
- *
- * @param addr memory block address to be freed
- */
-void buddy_free(void *addr)
-{
-	page_t * page = &g_pages[ADDR_TO_PAGE(addr)];
-	int index;
-	int currentOrder=page->order;
 
-	for(index = currentOrder; index<MAX_ORDER; index++)
-	{
-		page_t* buddy = &g_pages[ADDR_TO_PAGE(BUDDY_ADDR(page->address,index))];
-		int wasFreed = 0;
-		struct list_head *position;
+ //runs coalescing passes from the given order upwards for as long as the
+ //orders stay above the high watermark. The pool must be locked.
+ void coalesceFrom(buddy_pool_t* pool, int order)
+ {
+ 	for (; order < pool->max_order && pool->free_count[order] > pool->lazy_high; order++)
+ 	{
+ 		coalesceOrder(pool, order, pool->lazy_low);
+ 	}
+ }
 
-		list_for_each(position,&free_area[index])
-		{
-			if(list_entry(position,page_t,list)==buddy)
-			{
-				wasFreed = 1;
-			}
-		}
 
-		if (!wasFreed)
-		{
-			break;
-		}
+ //merges every free buddy pair of a lazy pool, used when a request cannot be
+ //satisfied otherwise. The pool must be locked. Returns the number of merges.
+ unsigned long coalesceAll(buddy_pool_t* pool)
+ {
+ 	unsigned long merges = 0;
 
-		list_del_init(&buddy->list);
+ 	for (int order = pool->min_order; order < pool->max_order; order++)
+ 	{
+ 		merges += coalesceOrder(pool, order, 0);
+ 	}
 
-		if(buddy<page)
-		{
-			page = buddy;
-		}
-	}
+ 	return merges;
+ }
 
-	page->order = index;
-	list_add(&page->list,&free_area[index]);
 
-}
+ //lists the range [start, end) of byte offsets as free, using the largest
+ //aligned blocks that fit. The range must be the unused tail of a block
+ //whose head is allocated, so none of the pieces can coalesce. The pool
+ //must be locked.
+ void addFreeRange(buddy_pool_t* pool, unsigned long start, unsigned long end, int released)
+ {
+ 	pool->used -= end - start;
+ 	while (start < end)
+ 	{
+ 		int order = __builtin_ctzl(start);
+ 		int fits = 63 - __builtin_clzl(end - start);
 
-/**
- * Print the buddy system status---order oriented
- *
- * print number of free pages in each order.
- */
-void buddy_dump()
-{
-	int o;
-	for (o = MIN_ORDER; o <= MAX_ORDER; o++) {
-		struct list_head *pos;
-		int cnt = 0;
-		list_for_each(pos, &free_area[o]) {
-			cnt++;
-		}
-		printf("%d:%dK ", cnt, (1<<o)/1024);
-	}
-	printf("\n");
+ 		if (fits < order)
+ 		{
+ 			order = fits;
+ 		}
+ 		addFreeBlock(pool, start >> pool->min_order, order, released);
+ 		pool->nr_splits++;
+ 		COUNT_OP(splits);
+ 		start += 1UL<<order;
+ 	}
+ }
+
+
+ //keeps only the first npages pages of an allocated block and lists the
+ //rest as free. The order of the block becomes the smallest one that covers
+ //what is kept. The pool must be locked.
+ void trimBlock(buddy_pool_t* pool, unsigned long page, unsigned long npages)
+ {
+ 	unsigned long start = page << pool->min_order;
+ 	unsigned long blockPages = 1UL << (PAGE_ORDER(pool, page) - pool->min_order);
+
+ 	if (npages >= blockPages)
+ 	{
+ 		return;
+ 	}
+
+ 	addFreeRange(pool, start + (npages << pool->min_order), start + (blockPages << pool->min_order), 0);
+ 	POOL_STATE(pool)[page] = pool->min_order + (npages > 1 ? 64 - __builtin_clzl(npages - 1) : 0);
+ 	PAGE_KEPT(pool, page) = npages == 1UL << (PAGE_ORDER(pool, page) - pool->min_order) ? 0 : npages;
+ }
+
+
+ //records the current use of the pool if it is the highest so far
+ void notePeak(buddy_pool_t* pool)
+ {
+ 	if (pool->used > pool->peak_used)
+ 	{
+ 		pool->peak_used = pool->used;
+ 	}
+ }
+
+
+ //size of an allocated block, only the pages an exact fit allocation kept
+ //count
+ unsigned long blockSize(buddy_pool_t* pool, unsigned long page)
+ {
+ 	unsigned long kept = PAGE_KEPT(pool, page);
+
+ 	return kept != 0 ? kept << pool->min_order : 1UL << PAGE_ORDER(pool, page);
+ }
+
+
+ //records the size of the request an allocated block serves
+ void setRequested(buddy_pool_t* pool, unsigned long page, size_t size)
+ {
+ 	unsigned long slack = blockSize(pool, page) - size;
+
+ 	PAGE_SLACK(pool, page) = slack < PAGE_NONE ? slack : PAGE_NONE;
+ }
+
+
+ //size of the request an allocated block serves
+ unsigned long requestedSize(buddy_pool_t* pool, unsigned long page)
+ {
+ 	return blockSize(pool, page) - PAGE_SLACK(pool, page);
+ }
+
+
+ //takes a block of the given order off the free lists, splitting a larger
+ //one if needed, and trims it to npages pages unless that is 0. The pool
+ //must be locked. Returns the first page of the block, or PAGE_NONE.
+ unsigned long allocBlock(buddy_pool_t* pool, int orderNeeded, unsigned long npages)
+ {
+ 	//orders that are both large enough and have a free block
+ 	unsigned long candidates = pool->free_mask & (~0UL << orderNeeded);
+
+ 	//a lazy pool may have enough memory in pieces that were never merged
+ 	if (candidates == 0 && pool->lazy_high > 0 && coalesceAll(pool) > 0)
+ 	{
+ 		candidates = pool->free_mask & (~0UL << orderNeeded);
+ 	}
+
+ 	if (candidates == 0)
+ 	{
+ 		return PAGE_NONE; //there was not enough memory available
+ 	}
+
+ 	int i = __builtin_ctzl(candidates); //smallest suitable order
+ 	unsigned long page = pool->free_area[i];
+ 	int released = removeFreeBlock(pool, page);
+ 	splitMemory(pool, page, i, orderNeeded, released);
+ 	POOL_STATE(pool)[page] = orderNeeded; //released memory is faulted back in on first touch
+ 	PAGE_KEPT(pool, page) = 0;
+ 	pool->used += 1UL << orderNeeded;
+ 	if (npages != 0)
+ 	{
+ 		trimBlock(pool, page, npages);
+ 	}
+ 	notePeak(pool);
+ 	return page;
+ }
+
+
+ //returns a block to the free lists, merging it with its free buddies and
+ //releasing the result if it is large enough. Lazy pools leave the block
+ //unmerged until its order goes over the high watermark. The pool must be
+ //locked.
+ void freeBlock(buddy_pool_t* pool, unsigned long page)
+ {
+ 	unsigned long freed = page;
+ 	int index;
+ 	int currentOrder=PAGE_ORDER(pool, page);
+ 	unsigned long dirty[BUDDY_MAX_ORDERS]; //merged buddies still backed by memory
+ 	int numDirty = 0;
+
+ 	pool->used -= 1UL << currentOrder;
+
+ 	if (pool->lazy_high > 0)
+ 	{
+ 		int released = pool->release_order > 0 && currentOrder >= pool->release_order;
+
+ 		if (released)
+ 		{
+ 			releaseBlock(pool, page, currentOrder);
+ 		}
+ 		addFreeBlock(pool, page, currentOrder, released);
+ 		coalesceFrom(pool, currentOrder);
+ 		return;
+ 	}
+
+ 	for(index = currentOrder; index<pool->max_order; index++)
+ 	{
+ 		unsigned long buddy = buddyOf(pool, page, index);
+
+ 		// the buddy is only mergeable if it is free as a whole at this order
+ 		if (buddy == PAGE_NONE || !isFreeBlock(pool, buddy, index))
+ 		{
+ 			break;
+ 		}
+
+ 		pool->nr_merges++;
+ 		COUNT_OP(merges);
+ 		if (!removeFreeBlock(pool, buddy))
+ 		{
+ 			dirty[numDirty++] = buddy;
+ 		}
+
+ 		if(buddy<page)
+ 		{
+ 			page = buddy;
+ 		}
+ 	}
+
+ 	if (pool->release_order > 0 && index >= pool->release_order)
+ 	{
+ 		releaseBlock(pool, freed, currentOrder);
+ 		for (int i = 0; i < numDirty; i++)
+ 		{
+ 			releaseBlock(pool, dirty[i], PAGE_ORDER(pool, dirty[i]));
+ 		}
+ 		addFreeBlock(pool, page, index, 1);
+ 	}
+ 	else
+ 	{
+ 		addFreeBlock(pool, page, index, 0);
+ 	}
+ }
+
+
+ //tags every page of a block as belonging to a slab or not
+ void tagSlabPages(buddy_pool_t* pool, unsigned long page, int isSlab)
+ {
+ 	int order = PAGE_ORDER(pool, page);
+ 	unsigned long numPages = 1UL << (order - pool->min_order);
+
+ 	memset(&POOL_STATE(pool)[page], order | (isSlab ? PAGE_SLAB : 0), numPages);
+ }
+
+
+ //finds the header of the slab an object belongs to, slabs are aligned to
+ //their size
+ slab_t* slabOf(buddy_pool_t* pool, unsigned long page, void* addr)
+ {
+ 	unsigned long offset = (char*)addr - POOL_MEMORY(pool);
+
+ 	return (slab_t*)(POOL_MEMORY(pool) + (offset & ~((1UL << PAGE_ORDER(pool, page)) - 1)));
+ }
+
+
+ //returns the size class serving a request of the given size
+ int slabClass(size_t size)
+ {
+ 	if (size <= (1UL<<SLAB_MIN_SHIFT))
+ 	{
+ 		return 0;
+ 	}
+ 	return 64 - __builtin_clzl(size - 1) - SLAB_MIN_SHIFT;
+ }
+
+
+ //hands out an object of the given class, carving a new slab out of the
+ //buddy free lists when no slab of the class has room left. The pool must be
+ //locked.
+ void* slabAlloc(buddy_pool_t* pool, int sizeClass)
+ {
+ 	struct list_head* partial = &pool->slab_partial[sizeClass];
+ 	size_t objectSize = 1UL << (sizeClass + SLAB_MIN_SHIFT);
+ 	slab_t* slab;
+ 	void* object;
+
+ 	if (list_empty(partial))
+ 	{
+ 		unsigned long page = allocBlock(pool, pool->slab_order[sizeClass], 0);
+ 		if (page == PAGE_NONE)
+ 		{
+ 			return NULL;
+ 		}
+
+ 		tagSlabPages(pool, page, 1);
+ 		slab = (slab_t*)PAGE_TO_ADDR(pool, page);
+ 		slab->free_objects = NULL;
+ 		slab->next_unused = SLAB_HEADER;
+ 		slab->size_class = sizeClass;
+ 		slab->in_use = 0;
+ 		slab->capacity = ((1UL << PAGE_ORDER(pool, page)) - SLAB_HEADER) / objectSize;
+ 		list_add(&slab->list, partial);
+ 	}
+
+ 	slab = list_entry(partial->next, slab_t, list);
+ 	if (slab->free_objects != NULL)
+ 	{
+ 		object = slab->free_objects;
+ 		slab->free_objects = *(void**)object;
+ 	}
+ 	else
+ 	{
+ 		object = (char*)slab + slab->next_unused;
+ 		slab->next_unused += objectSize;
+ 	}
+
+ 	//full slabs are not on any list until an object comes back
+ 	if (++slab->in_use == slab->capacity)
+ 	{
+ 		list_del_init(&slab->list);
+ 	}
+
+ 	//objects count as granted and requested in full
+ 	pool->allocated += objectSize;
+ 	pool->requested += objectSize;
+ 	return object;
+ }
+
+
+ //takes an object back into its slab and returns the slab to the buddy free
+ //lists once it is empty. The pool must be locked.
+ void slabFree(buddy_pool_t* pool, unsigned long page, void* addr)
+ {
+ 	slab_t* slab = slabOf(pool, page, addr);
+
+ 	*(void**)addr = slab->free_objects;
+ 	slab->free_objects = addr;
+ 	pool->allocated -= 1UL << (slab->size_class + SLAB_MIN_SHIFT);
+ 	pool->requested -= 1UL << (slab->size_class + SLAB_MIN_SHIFT);
+
+ 	if (slab->in_use-- == slab->capacity)
+ 	{
+ 		list_add(&slab->list, &pool->slab_partial[slab->size_class]);
+ 	}
+
+ 	if (slab->in_use == 0)
+ 	{
+ 		unsigned long head = ADDR_TO_PAGE(pool, slab);
+
+ 		list_del(&slab->list);
+ 		tagSlabPages(pool, head, 0);
+ 		freeBlock(pool, head);
+ 	}
+ }
+
+
+ //grows an allocated block to the given order by absorbing its right hand
+ //buddies, which must all be free at the matching orders. The pool must be
+ //locked. Returns 0 if the block cannot grow in place.
+ int growBlock(buddy_pool_t* pool, unsigned long page, int order)
+ {
+ 	for (int o = PAGE_ORDER(pool, page); o < order; o++)
+ 	{
+ 		unsigned long buddy = page + (1UL<<(o - pool->min_order));
+
+ 		//the block must be the left half at every level it grows through
+ 		if (BUDDY_PAGE(pool, page, o) != buddy || buddy >= pool->num_pages ||
+ 		    !isFreeBlock(pool, buddy, o))
+ 		{
+ 			return 0;
+ 		}
+ 	}
+
+ 	for (int o = PAGE_ORDER(pool, page); o < order; o++)
+ 	{
+ 		removeFreeBlock(pool, page + (1UL<<(o - pool->min_order)));
+ 	}
+ 	pool->used += (1UL<<order) - (1UL<<PAGE_ORDER(pool, page));
+ 	POOL_STATE(pool)[page] = order;
+ 	return 1;
+ }
+
+
+ //shrinks an allocated block to the given order by freeing the right hand
+ //halves split off its tail. The pool must be locked.
+ void shrinkBlock(buddy_pool_t* pool, unsigned long page, int order)
+ {
+ 	while (PAGE_ORDER(pool, page) > order)
+ 	{
+ 		int o = PAGE_ORDER(pool, page) - 1;
+ 		unsigned long tail = BUDDY_PAGE(pool, page, o);
+
+ 		POOL_STATE(pool)[page] = o;
+ 		POOL_STATE(pool)[tail] = o;
+ 		pool->nr_splits++;
+ 		COUNT_OP(splits);
+ 		freeBlock(pool, tail);
+ 	}
+ }
+
+
+ //frees the range [start, end) of byte offsets piece by piece, using the
+ //largest aligned blocks that fit. Pieces coalesce as usual, so freeing the
+ //pieces of a trimmed block rebuilds it. The pool must be locked.
+ void freeRange(buddy_pool_t* pool, unsigned long start, unsigned long end)
+ {
+ 	while (start < end)
+ 	{
+ 		int order = start ? __builtin_ctzl(start) : 63;
+ 		int fits = 63 - __builtin_clzl(end - start);
+
+ 		if (fits < order)
+ 		{
+ 			order = fits;
+ 		}
+
+ 		POOL_STATE(pool)[start >> pool->min_order] = order;
+ 		freeBlock(pool, start >> pool->min_order);
+ 		start += 1UL<<order;
+ 	}
+ }
+
+
+ //returns the order traced for a block, -1 for a failed allocation
+ int traceOrder(buddy_pool_t* pool, void* addr)
+ {
+ 	return addr != NULL ? PAGE_ORDER(pool, ADDR_TO_PAGE(pool, addr)) : -1;
+ }
+
+ //returns the histogram bucket of a latency
+ int histBucket(uint64_t ticks)
+ {
+ 	if (ticks < (1UL << BUDDY_HIST_SUB_BITS))
+ 	{
+ 		return ticks;
+ 	}
+ 	if (ticks >> BUDDY_HIST_MAX_SHIFT)
+ 	{
+ 		return BUDDY_HIST_BUCKETS - 1;
+ 	}
+
+ 	//the bits below the highest BUDDY_HIST_SUB_BITS + 1 are dropped
+ 	int shift = 63 - __builtin_clzl(ticks) - BUDDY_HIST_SUB_BITS;
+
+ 	return ((shift + 1) << BUDDY_HIST_SUB_BITS) + (ticks >> shift) - (1UL << BUDDY_HIST_SUB_BITS);
+ }
+
+ //orders addresses for buddy_pool_free_bulk
+ int compareAddresses(const void* a, const void* b)
+ {
+ 	char* left = *(char* const*)a;
+ 	char* right = *(char* const*)b;
+
+ 	return (left > right) - (left < right);
+ }
+
+#if USE_THREADS == 1
+
+ //flushes a thread cache back to its pool when the thread exits
+ void destroyThreadCache(void* arg)
+ {
+ 	thread_cache_t* cache = arg;
+ 	buddy_pool_t* pool = cache->pool;
+ 	int numOrders = pool->cache_max_order - pool->min_order + 1;
+
+ 	LOCK_POOL(pool);
+ 	for (int o = 0; o < numOrders; o++)
+ 	{
+ 		for (int i = 0; i < cache->count[o]; i++)
+ 		{
+ 			freeBlock(pool, cache->blocks[o * pool->cache_size + i]);
+ 		}
+ 	}
+ 	list_del(&cache->list);
+ 	pool->allocated += cache->allocated;
+ 	pool->requested += cache->requested;
+ 	UNLOCK_POOL(pool);
+
+ 	free(cache);
+ }
+
+
+ //returns the calling thread's cache for the pool, creating it on first use
+ thread_cache_t* getThreadCache(buddy_pool_t* pool)
+ {
+ 	thread_cache_t* cache = pthread_getspecific(pool->cache_key);
+
+ 	if (cache != NULL)
+ 	{
+ 		return cache;
+ 	}
+
+ 	int numOrders = pool->cache_max_order - pool->min_order + 1;
+ 	cache = calloc(1, sizeof(thread_cache_t) + sizeof(uint32_t) * numOrders * pool->cache_size);
+ 	if (cache == NULL)
+ 	{
+ 		return NULL; //fall back to the shared free lists
+ 	}
+
+ 	cache->pool = pool;
+ 	pthread_setspecific(pool->cache_key, cache);
+
+ 	LOCK_POOL(pool);
+ 	list_add(&cache->list, &pool->caches);
+ 	UNLOCK_POOL(pool);
+
+ 	return cache;
+ }
+
+
+ //adds to a thread's share of the allocated and requested bytes of its
+ //pool. The stores are atomic since buddy_pool_get_stats reads them from
+ //other threads.
+ void cacheAccount(thread_cache_t* cache, unsigned long allocated, unsigned long requested)
+ {
+ 	__atomic_store_n(&cache->allocated, cache->allocated + allocated, __ATOMIC_RELAXED);
+ 	__atomic_store_n(&cache->requested, cache->requested + requested, __ATOMIC_RELAXED);
+ }
+
+
+ //returns every block held by the calling thread's cache to the free lists,
+ //so a request they cannot satisfy can try again with that memory. The pool
+ //must be locked. Returns the number of blocks returned.
+ int drainThreadCache(buddy_pool_t* pool)
+ {
+ 	thread_cache_t* cache;
+ 	int drained = 0;
+
+ 	if (pool->cache_max_order < 0 || (cache = pthread_getspecific(pool->cache_key)) == NULL)
+ 	{
+ 		return 0;
+ 	}
+
+ 	for (int o = 0; o <= pool->cache_max_order - pool->min_order; o++)
+ 	{
+ 		for (int i = 0; i < cache->count[o]; i++)
+ 		{
+ 			freeBlock(pool, cache->blocks[o * pool->cache_size + i]);
+ 		}
+ 		drained += cache->count[o];
+ 		cache->count[o] = 0;
+ 	}
+ 	return drained;
+ }
+
+
+ //takes a block from a thread cache, refilling half of it from the shared
+ //free lists under a single lock when it is empty. Returns PAGE_NONE if the
+ //pool is out of memory.
+ unsigned long cachePop(thread_cache_t* cache, int order)
+ {
+ 	buddy_pool_t* pool = cache->pool;
+ 	int slot = order - pool->min_order;
+ 	uint32_t* blocks = &cache->blocks[slot * pool->cache_size];
+
+ 	if (cache->count[slot] == 0)
+ 	{
+ 		int batch = (pool->cache_size + 1) / 2;
+
+ 		LOCK_POOL(pool);
+ 		while (cache->count[slot] < batch)
+ 		{
+ 			unsigned long page = allocBlock(pool, order, 0);
+ 			if (page == PAGE_NONE && cache->count[slot] == 0 && drainThreadCache(pool) > 0)
+ 			{
+ 				page = allocBlock(pool, order, 0); //the memory sat in other orders
+ 			}
+ 			if (page == PAGE_NONE)
+ 			{
+ 				break;
+ 			}
+ 			blocks[cache->count[slot]++] = page;
+ 		}
+ 		UNLOCK_POOL(pool);
+
+ 		if (cache->count[slot] == 0)
+ 		{
+ 			return PAGE_NONE;
+ 		}
+ 	}
+
+ 	return blocks[--cache->count[slot]];
+ }
+
+
+ //puts a block in a thread cache, draining the older half of it back to the
+ //shared free lists under a single lock when it is full
+ void cachePush(thread_cache_t* cache, unsigned long page)
+ {
+ 	buddy_pool_t* pool = cache->pool;
+ 	int slot = PAGE_ORDER(pool, page) - pool->min_order;
+ 	uint32_t* blocks = &cache->blocks[slot * pool->cache_size];
+
+ 	if (cache->count[slot] == pool->cache_size)
+ 	{
+ 		int batch = (pool->cache_size + 1) / 2;
+
+ 		LOCK_POOL(pool);
+ 		for (int i = 0; i < batch; i++)
+ 		{
+ 			freeBlock(pool, blocks[i]);
+ 		}
+ 		UNLOCK_POOL(pool);
+
+ 		cache->count[slot] -= batch;
+ 		for (int i = 0; i < cache->count[slot]; i++)
+ 		{
+ 			blocks[i] = blocks[i + batch];
+ 		}
+ 	}
+
+ 	blocks[cache->count[slot]++] = page;
+ }
+
+
+#endif
+
+
+
+#if USE_TRACE == 1 || USE_HISTOGRAM == 1
+
+ //reads a nanosecond clock
+ uint64_t readClock()
+ {
+ 	struct timespec now;
+
+ 	clock_gettime(CLOCK_MONOTONIC, &now);
+ 	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+ }
+
+
+ //reads the time stamp counter, or the nanosecond clock where there is none
+ uint64_t readTimestamp()
+ {
+#if defined(__x86_64__) || defined(__i386__)
+ 	return __builtin_ia32_rdtsc();
+#else
+ 	return readClock();
+#endif
+ }
+
+#endif
+
+
+
+#if USE_TRACE == 1
+
+
+ //marks the ring of an exiting thread, the next drain that empties it frees it
+ void exitTraceRing(void* arg)
+ {
+ 	trace_ring_t* ring = arg;
+
+ 	//events of later destructors go to a new ring
+ 	g_trace_local.ring = NULL;
+ 	__atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+ }
+
+
+ void createTraceKey()
+ {
+ 	pthread_key_create(&g_trace_key, exitTraceRing);
+ }
+
+
+ //creates the calling thread's ring on its first event
+ trace_ring_t* getTraceRing()
+ {
+ 	trace_ring_t* ring = calloc(1, sizeof(trace_ring_t));
+
+ 	if (ring == NULL)
+ 	{
+ 		return NULL; //the event is dropped
+ 	}
+
+ 	pthread_once(&g_trace_once, createTraceKey);
+ 	pthread_setspecific(g_trace_key, ring);
+
+ 	pthread_mutex_lock(&g_trace_lock);
+ 	ring->thread = g_trace_threads++;
+ 	list_add_tail(&ring->list, &g_trace_rings);
+ 	pthread_mutex_unlock(&g_trace_lock);
+
+ 	g_trace_local.ring = ring;
+ 	return ring;
+ }
+
+
+ //appends an event to the calling thread's ring along with the splits and
+ //merges the thread did since its last one, or drops it if the ring is full
+ void traceEvent(int type, void* addr, size_t size, int order)
+ {
+ 	trace_ring_t* ring = g_trace_local.ring;
+ 	unsigned long splits = g_op_counts.splits - g_trace_local.splits;
+ 	unsigned long merges = g_op_counts.merges - g_trace_local.merges;
+
+ 	g_trace_local.splits = g_op_counts.splits;
+ 	g_trace_local.merges = g_op_counts.merges;
+
+ 	if (ring == NULL && (ring = getTraceRing()) == NULL)
+ 	{
+ 		return;
+ 	}
+
+ 	unsigned long head = ring->head;
+
+ 	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+ 	{
+ 		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+ 		return;
+ 	}
+
+ 	struct buddy_trace_event* event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+ 	event->timestamp = readTimestamp();
+ 	event->addr = (uintptr_t)addr;
+ 	event->size = size;
+ 	event->type = type;
+ 	event->order = order;
+ 	event->splits = splits < UINT16_MAX ? splits : UINT16_MAX;
+ 	event->merges = merges < UINT16_MAX ? merges : UINT16_MAX;
+ 	event->thread = ring->thread;
+
+ 	//publishes the event to drains
+ 	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+ }
+
+
+ //records one event per block of a batch
+ void traceBatch(buddy_pool_t* pool, int type, void** addrs, int n, size_t size)
+ {
+ 	for (int i = 0; i < n; i++)
+ 	{
+ 		traceEvent(type, addrs[i], size, traceOrder(pool, addrs[i]));
+ 	}
+ }
+
+#endif
+
+
+
+#if USE_HISTOGRAM == 1
+
+ //adds the counts of a histogram that may still be written to another one
+ void addHistogram(struct buddy_histogram* into, struct buddy_histogram* from)
+ {
+ 	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+
+ 	into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+ 	into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+ 	into->max = max > into->max ? max : into->max;
+ 	for (int i = 0; i < BUDDY_HIST_BUCKETS; i++)
+ 	{
+ 		into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+ 	}
+ }
+
+
+ //adds the histograms of a thread that match an op, order and outcome, -1
+ //matching any order or outcome
+ void sumHistograms(hist_local_t* local, int op, int order, int outcome, struct buddy_histogram* hist)
+ {
+ 	for (int o = 0; o < BUDDY_MAX_ORDERS; o++)
+ 	{
+ 		for (int k = 0; k < BUDDY_HIST_OUTCOMES; k++)
+ 		{
+ 			struct buddy_histogram* from = __atomic_load_n(&local->hist[op][o][k], __ATOMIC_ACQUIRE);
+
+ 			if (from != NULL && (order < 0 || order == o) && (outcome < 0 || outcome == k))
+ 			{
+ 				addHistogram(hist, from);
+ 			}
+ 		}
+ 	}
+ }
+
+
+ //zeroes the histograms of a thread
+ void clearHistograms(hist_local_t* local)
+ {
+ 	struct buddy_histogram** hist = &local->hist[0][0][0];
+
+ 	for (int i = 0; i < BUDDY_HIST_OPS * BUDDY_MAX_ORDERS * BUDDY_HIST_OUTCOMES; i++)
+ 	{
+ 		struct buddy_histogram* h = __atomic_load_n(&hist[i], __ATOMIC_ACQUIRE);
+
+ 		if (h != NULL)
+ 		{
+ 			__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+ 			__atomic_store_n(&h->total, 0, __ATOMIC_RELAXED);
+ 			__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+ 			for (int b = 0; b < BUDDY_HIST_BUCKETS; b++)
+ 			{
+ 				__atomic_store_n(&h->buckets[b], 0, __ATOMIC_RELAXED);
+ 			}
+ 		}
+ 	}
+ }
+
+
+ //folds the histograms of an exiting thread into g_hist_exited
+ void exitHistograms(void* arg)
+ {
+ 	hist_local_t* local = arg;
+ 	struct buddy_histogram** hist = &local->hist[0][0][0];
+ 	struct buddy_histogram** exited = &g_hist_exited.hist[0][0][0];
+
+ 	pthread_mutex_lock(&g_hist_lock);
+ 	for (int i = 0; i < BUDDY_HIST_OPS * BUDDY_MAX_ORDERS * BUDDY_HIST_OUTCOMES; i++)
+ 	{
+ 		if (hist[i] != NULL && exited[i] == NULL)
+ 		{
+ 			exited[i] = hist[i];
+ 		}
+ 		else if (hist[i] != NULL)
+ 		{
+ 			addHistogram(exited[i], hist[i]);
+ 			free(hist[i]);
+ 		}
+ 	}
+ 	list_del(&local->list);
+ 	pthread_mutex_unlock(&g_hist_lock);
+
+ 	//calls made by later destructors start over
+ 	g_hist_local = NULL;
+ 	free(local);
+ }
+
+
+ void createHistKey()
+ {
+ 	pthread_key_create(&g_hist_key, exitHistograms);
+ 	g_hist_epoch_ticks = readTimestamp();
+ 	g_hist_epoch_ns = readClock();
+ }
+
+
+ //creates the calling thread's histograms on its first timed call
+ hist_local_t* getHistograms()
+ {
+ 	hist_local_t* local = calloc(1, sizeof(hist_local_t));
+
+ 	if (local == NULL)
+ 	{
+ 		return NULL; //the call is not recorded
+ 	}
+
+ 	pthread_once(&g_hist_once, createHistKey);
+ 	pthread_setspecific(g_hist_key, local);
+
+ 	pthread_mutex_lock(&g_hist_lock);
+ 	list_add_tail(&local->list, &g_hist_threads);
+ 	pthread_mutex_unlock(&g_hist_lock);
+
+ 	g_hist_local = local;
+ 	return local;
+ }
+
+
+ //records the latency of a call that started at the given time stamp, and
+ //classifies it by the work the thread did since the given counts
+ void recordLatency(int op, int order, uint64_t start, const op_counts_t* before)
+ {
+ 	uint64_t ticks = readTimestamp() - start;
+ 	hist_local_t* local = g_hist_local;
+ 	int outcome = BUDDY_HIST_HIT;
+
+ 	if (g_op_counts.merges != before->merges)
+ 	{
+ 		outcome = BUDDY_HIST_MERGE;
+ 	}
+ 	else if (g_op_counts.splits != before->splits)
+ 	{
+ 		outcome = BUDDY_HIST_SPLIT;
+ 	}
+ 	else if (g_op_counts.locks != before->locks)
+ 	{
+ 		outcome = BUDDY_HIST_MISS;
+ 	}
+
+ 	if (order < 0 || (local == NULL && (local = getHistograms()) == NULL))
+ 	{
+ 		return; //requests larger than the pool are not recorded
+ 	}
+
+ 	struct buddy_histogram* hist = local->hist[op][order][outcome];
+
+ 	if (hist == NULL)
+ 	{
+ 		if ((hist = calloc(1, sizeof(struct buddy_histogram))) == NULL)
+ 		{
+ 			return;
+ 		}
+ 		__atomic_store_n(&local->hist[op][order][outcome], hist, __ATOMIC_RELEASE);
+ 	}
+
+ 	//only this thread writes, the stores just keep readers from tearing
+ 	int bucket = histBucket(ticks);
+
+ 	__atomic_store_n(&hist->buckets[bucket], hist->buckets[bucket] + 1, __ATOMIC_RELAXED);
+ 	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+ 	__atomic_store_n(&hist->total, hist->total + ticks, __ATOMIC_RELAXED);
+ 	if (ticks > hist->max)
+ 	{
+ 		__atomic_store_n(&hist->max, ticks, __ATOMIC_RELAXED);
+ 	}
+ }
+
+
+ //measures the length of a time stamp tick against the clock
+ double nsPerTick()
+ {
+#if defined(__x86_64__) || defined(__i386__)
+ 	uint64_t ticks, ns;
+
+ 	pthread_once(&g_hist_once, createHistKey);
+
+ 	//wait for a long enough baseline, only the first reads ever do
+ 	do
+ 	{
+ 		ticks = readTimestamp() - g_hist_epoch_ticks;
+ 		ns = readClock() - g_hist_epoch_ns;
+ 	} while (ns < 10000000);
+
+ 	return (double)ns / ticks;
+#else
+ 	return 1.0;
+#endif
+ }
+
+#endif
+
+
+
+ //allocates a block, see buddy_pool_alloc
+ void* allocFromPool(buddy_pool_t* pool, size_t size)
+ {
+ 	if (pool->slab && size <= SLAB_MAX_SIZE)
+ 	{
+ 		int sizeClass = slabClass(size);
+
+ 		if (pool->slab_order[sizeClass] != -1)
+ 		{
+ 			void *object;
+
+ 			LOCK_POOL(pool);
+ 			object = slabAlloc(pool, sizeClass);
+ 			UNLOCK_POOL(pool);
+ 			TRACE(BUDDY_TRACE_ALLOC, object, size, traceOrder(pool, object));
+ 			return object;
+ 		}
+ 	}
+
+ 	int orderNeeded = determineOrder(pool, size);
+ 	unsigned long page;
+
+ 	if( orderNeeded == -1) //too big of a request
+ 	{
+ 		TRACE(BUDDY_TRACE_ALLOC, NULL, size, -1);
+ 		return NULL;
+ 	}
+
+#if USE_THREADS == 1
+ 	if (orderNeeded <= pool->cache_max_order)
+ 	{
+ 		thread_cache_t *cache = getThreadCache(pool);
+
+ 		if (cache != NULL)
+ 		{
+ 			page = cachePop(cache, orderNeeded);
+ 			if (page == PAGE_NONE)
+ 			{
+ 				TRACE(BUDDY_TRACE_ALLOC, NULL, size, -1);
+ 				return NULL;
+ 			}
+ 			setRequested(pool, page, size);
+ 			cacheAccount(cache, 1UL << orderNeeded, size);
+ 			TRACE(BUDDY_TRACE_ALLOC, PAGE_TO_ADDR(pool, page), size, orderNeeded);
+ 			return PAGE_TO_ADDR(pool, page);
+ 		}
+ 	}
+#endif
+
+ 	unsigned long npages = pool->exact_fit ? (size + PAGE_SIZE(pool) - 1) >> pool->min_order : 0;
+
+ 	LOCK_POOL(pool);
+ 	page = allocBlock(pool, orderNeeded, npages);
+#if USE_THREADS == 1
+ 	if (page == PAGE_NONE && drainThreadCache(pool) > 0)
+ 	{
+ 		page = allocBlock(pool, orderNeeded, npages); //the memory sat in this thread's cache
+ 	}
+#endif
+ 	if (page != PAGE_NONE)
+ 	{
+ 		setRequested(pool, page, size);
+ 		pool->allocated += blockSize(pool, page);
+ 		pool->requested += size;
+ 	}
+ 	UNLOCK_POOL(pool);
+
+ 	void *addr = page != PAGE_NONE ? PAGE_TO_ADDR(pool, page) : NULL;
+
+ 	TRACE(BUDDY_TRACE_ALLOC, addr, size, page != PAGE_NONE ? PAGE_ORDER(pool, page) : -1);
+ 	return addr;
+ }
+
+
+ //frees a block, see buddy_pool_free
+ void freeToPool(buddy_pool_t* pool, void* addr)
+ {
+ 	if (addr == NULL)
+ 	{
+ 		return;
+ 	}
+
+ 	unsigned long page = ADDR_TO_PAGE(pool, addr);
+ 	int order = PAGE_ORDER(pool, page);
+
+ 	if (POOL_STATE(pool)[page] & PAGE_SLAB)
+ 	{
+ 		LOCK_POOL(pool);
+ 		slabFree(pool, page, addr);
+ 		UNLOCK_POOL(pool);
+ 		TRACE(BUDDY_TRACE_FREE, addr, 0, order);
+ 		return;
+ 	}
+
+#if USE_THREADS == 1
+ 	if (order <= pool->cache_max_order && PAGE_KEPT(pool, page) == 0)
+ 	{
+ 		thread_cache_t *cache = getThreadCache(pool);
+
+ 		if (cache != NULL)
+ 		{
+ 			cacheAccount(cache, -blockSize(pool, page), -requestedSize(pool, page));
+ 			cachePush(cache, page);
+ 			TRACE(BUDDY_TRACE_FREE, addr, 0, order);
+ 			return;
+ 		}
+ 	}
+#endif
+
+ 	LOCK_POOL(pool);
+ 	pool->allocated -= blockSize(pool, page);
+ 	pool->requested -= requestedSize(pool, page);
+ 	if (PAGE_KEPT(pool, page) != 0)
+ 	{
+ 		//rebuild a trimmed block from the pieces it kept
+ 		unsigned long start = page << pool->min_order;
+
+ 		freeRange(pool, start, start + ((unsigned long)PAGE_KEPT(pool, page) << pool->min_order));
+ 	}
+ 	else
+ 	{
+ 		freeBlock(pool, page);
+ 	}
+ 	UNLOCK_POOL(pool);
+ 	TRACE(BUDDY_TRACE_FREE, addr, 0, order);
+ }
+
+
+ //fills in the settings and shape of a pool from a configuration, returns 0
+ //if the configuration is invalid
+ int configurePool(buddy_pool_t* pool, const buddy_pool_config_t* config)
+ {
+ 	int min_order = config->min_order;
+ 	size_t size = config->size;
+
+ 	if (min_order < 0 || min_order >= BUDDY_MAX_ORDERS - 1)
+ 	{
+ 		return 0;
+ 	}
+
+ 	size &= ~((1UL<<min_order) - 1);
+ 	if (size == 0 || (size >> min_order) >= PAGE_NONE)
+ 	{
+ 		return 0;
+ 	}
+
+ 	pool->size = size;
+ 	pool->min_order = min_order;
+ 	pool->max_order = 63 - __builtin_clzl(size);
+ 	pool->num_pages = size >> min_order;
+ 	pool->release_order = config->release_order;
+ 	pool->file_fd = -1;
+ 	pool->cache_max_order = -1;
+ 	pool->cache_size = config->cache_size;
+#if USE_THREADS == 1
+ 	if (config->cache_max_order > 0 && config->cache_max_order >= min_order &&
+ 	    config->cache_size > 1)
+ 	{
+ 		pool->cache_max_order = config->cache_max_order < pool->max_order ?
+ 		                        config->cache_max_order : pool->max_order;
+ 	}
+#endif
+ 	pool->slab = config->slab;
+ 	pool->exact_fit = config->exact_fit;
+ 	pool->lazy_high = config->lazy_high_watermark > 0 ? config->lazy_high_watermark : 0;
+ 	pool->lazy_low = pool->lazy_high / 2;
+ 	if (config->lazy_low_watermark >= 0 &&
+ 	    (unsigned long)config->lazy_low_watermark < pool->lazy_high)
+ 	{
+ 		pool->lazy_low = config->lazy_low_watermark;
+ 	}
+ 	for (int c = 0; c < SLAB_CLASSES; c++)
+ 	{
+ 		size_t objectSize = 1UL << (c + SLAB_MIN_SHIFT);
+ 		int o = min_order;
+
+ 		while (o <= pool->max_order &&
+ 		       (1UL<<o) < SLAB_HEADER + SLAB_MIN_OBJECTS * objectSize)
+ 		{
+ 			o++;
+ 		}
+ 		pool->slab_order[c] = o <= pool->max_order ? o : -1;
+ 		INIT_LIST_HEAD(&pool->slab_partial[c]);
+ 	}
+#ifdef MADV_FREE
+ 	pool->release_advice = config->release_lazily ? MADV_FREE : MADV_DONTNEED;
+#else
+ 	pool->release_advice = MADV_DONTNEED;
+#endif
+
+ 	return 1;
+ }
+
+
+ //points a pool at its page metadata: the next links, the prev links, then
+ //the state bytes
+ void placeMetadata(buddy_pool_t* pool, char* metadata)
+ {
+ 	pool->next_offset = (intptr_t)metadata - (intptr_t)pool;
+ 	pool->prev_offset = pool->next_offset + pool->num_pages * sizeof(uint32_t);
+ 	pool->state_offset = pool->prev_offset + pool->num_pages * sizeof(uint32_t);
+ }
+
+
+ //lists the entire arena as free, largest blocks first so every block is
+ //aligned to its size. None of it has been touched yet.
+ void seedPool(buddy_pool_t* pool)
+ {
+ 	unsigned long offset = 0;
+
+ 	for (int i = 0; i < BUDDY_MAX_ORDERS; i++)
+ 	{
+ 		pool->free_area[i] = PAGE_NONE;
+ 	}
+ 	for (int o = pool->max_order; o >= pool->min_order; o--)
+ 	{
+ 		if (pool->size & (1UL<<o))
+ 		{
+ 			addFreeBlock(pool, offset >> pool->min_order, o, 1);
+ 			offset += 1UL<<o;
+ 		}
+ 	}
+ }
+
+
+ //maps length bytes so that the byte at alignOffset is aligned to align,
+ //over-reserving and giving the unused head and tail back. The file fd is
+ //mapped shared, or fresh memory if fd is -1. Returns NULL on failure.
+ char* mapAligned(size_t length, size_t alignOffset, unsigned long align, int fd)
+ {
+ 	size_t reserve = length + align;
+ 	char *mapping = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+ 	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+ 	if (mapping == MAP_FAILED)
+ 	{
+ 		return NULL;
+ 	}
+
+ 	char *start = (char *)((((unsigned long)mapping + alignOffset + align - 1) & ~(align - 1)) - alignOffset);
+ 	size_t head = start - mapping;
+ 	size_t tail = reserve - head - length;
+
+ 	if (fd != -1 && mmap(start, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+ 	{
+ 		munmap(mapping, reserve);
+ 		return NULL;
+ 	}
+ 	if (head > 0)
+ 	{
+ 		munmap(mapping, head);
+ 	}
+ 	if (tail > 0)
+ 	{
+ 		munmap(start + length, tail);
+ 	}
+ 	return start;
+ }
+
+
+ //bytes of a segment or file holding a pool of the given shape, and where
+ //its arena starts: the header, the pool, its metadata, then the arena on a
+ //page boundary
+ size_t segmentLength(const buddy_pool_t* shape, size_t* arenaOffset)
+ {
+ 	size_t page = PAGE_SIZE(shape) > SHARED_PAGE_SIZE ? PAGE_SIZE(shape) : SHARED_PAGE_SIZE;
+
+ 	*arenaOffset = (SEGMENT_META_OFFSET + shape->num_pages * PAGE_METADATA + page - 1) & ~(page - 1);
+ 	return *arenaOffset + shape->size;
+ }
+
+
+ //sets up a pool of the given shape in a freshly mapped, zero filled
+ //segment, see segmentLength. Returns the pool.
+ buddy_pool_t* placePool(char* segment, const buddy_pool_t* shape, size_t length, size_t arenaOffset)
+ {
+ 	buddy_pool_t* pool = (buddy_pool_t*)(segment + SHARED_POOL_OFFSET);
+
+ 	*pool = *shape;
+ 	//the list heads copied from the shape still point into it
+ 	for (int c = 0; c < SLAB_CLASSES; c++)
+ 	{
+ 		INIT_LIST_HEAD(&pool->slab_partial[c]);
+ 	}
+#if USE_THREADS == 1
+ 	INIT_LIST_HEAD(&pool->caches);
+#endif
+ 	pool->memory_offset = arenaOffset - SHARED_POOL_OFFSET;
+ 	placeMetadata(pool, segment + SEGMENT_META_OFFSET);
+ 	pool->shared_length = length;
+#ifdef MADV_REMOVE
+ 	pool->release_advice = MADV_REMOVE; //punches the block out of the segment
+#endif
+ 	seedPool(pool);
+ 	return pool;
+ }
+
+
+ //fills in the header of a segment once its pool is ready. The magic goes
+ //in last, the pool can be opened from then on.
+ void publishSegment(char* segment, buddy_pool_t* pool, size_t arenaOffset, const char* magic)
+ {
+ 	shared_header_t* header = (shared_header_t*)segment;
+
+ 	header->length = pool->shared_length;
+ 	header->arena_offset = arenaOffset;
+ 	header->max_order = pool->max_order;
+ 	header->layout = sizeof(buddy_pool_t);
+ 	__atomic_thread_fence(__ATOMIC_RELEASE);
+ 	memcpy(header->magic, magic, sizeof(header->magic));
+ }
+
+
+ //maps the segment or file fd if its header carries the given magic and
+ //comes from a build with the same pool layout. Returns NULL otherwise, or
+ //if the header or the pool in it describe a shape the segment cannot hold,
+ //as a truncated or damaged file would: touching the missing tail of a
+ //shared mapping raises SIGBUS.
+ char* mapSegment(int fd, const char* magic)
+ {
+ 	shared_header_t header;
+ 	struct stat st;
+
+ 	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+ 	    memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+ 	    header.layout != sizeof(buddy_pool_t) ||
+ 	    fstat(fd, &st) != 0 || (size_t)st.st_size < header.length)
+ 	{
+ 		return NULL;
+ 	}
+
+ 	//the arena is one block of max_order plus a tail, after the metadata
+ 	if (header.max_order < 0 || header.max_order >= BUDDY_MAX_ORDERS ||
+ 	    header.arena_offset < SEGMENT_META_OFFSET ||
+ 	    header.arena_offset % SHARED_PAGE_SIZE != 0 ||
+ 	    header.arena_offset >= header.length ||
+ 	    (header.length - header.arena_offset) >> header.max_order != 1)
+ 	{
+ 		return NULL;
+ 	}
+
+ 	char* segment = mapAligned(header.length, header.arena_offset, 1UL<<header.max_order, fd);
+
+ 	if (segment == NULL)
+ 	{
+ 		return NULL;
+ 	}
+
+ 	//the pool must have been placed for exactly this segment
+ 	buddy_pool_t* pool = (buddy_pool_t*)(segment + SHARED_POOL_OFFSET);
+ 	intptr_t links = pool->num_pages * sizeof(uint32_t);
+ 	size_t arenaOffset;
+
+ 	if (pool->max_order != header.max_order || pool->min_order < 0 ||
+ 	    pool->min_order > pool->max_order || pool->size >> pool->max_order != 1 ||
+ 	    pool->num_pages != pool->size >> pool->min_order ||
+ 	    pool->num_pages >= PAGE_NONE || pool->shared_length != header.length ||
+ 	    segmentLength(pool, &arenaOffset) != header.length ||
+ 	    arenaOffset != header.arena_offset ||
+ 	    pool->memory_offset != (intptr_t)(arenaOffset - SHARED_POOL_OFFSET) ||
+ 	    pool->next_offset != SEGMENT_META_OFFSET - SHARED_POOL_OFFSET ||
+ 	    pool->prev_offset != pool->next_offset + links ||
+ 	    pool->state_offset != pool->prev_offset + links)
+ 	{
+ 		munmap(segment, header.length);
+ 		return NULL;
+ 	}
+ 	return segment;
+ }
+
+
+ //rebuilds the free lists and the byte counts of a pool from its state
+ //bytes alone, for a file pool whose last process died with it open or a
+ //shared pool whose lock holder died. Every block head gives the length of
+ //its block, so the walk goes from head to head and touches one state byte
+ //per block. A block that was being split or
+ //merged at the time is lost: its head still covers it, but whatever the
+ //operation was doing inside of it is not trusted.
+ void recoverPool(buddy_pool_t* pool)
+ {
+ 	unsigned char* state = POOL_STATE(pool);
+ 	unsigned long page = 0;
+
+ 	for (int i = 0; i < BUDDY_MAX_ORDERS; i++)
+ 	{
+ 		pool->free_area[i] = PAGE_NONE;
+ 		pool->free_count[i] = 0;
+ 	}
+ 	pool->free_mask = 0;
+ 	pool->used = 0;
+ 	pool->allocated = 0;
+ 	pool->requested = 0;
+
+ 	while (page < pool->num_pages)
+ 	{
+ 		int order = state[page] & PAGE_ORDER_MASK;
+ 		unsigned long npages = 1UL << (order - pool->min_order);
+
+ 		//a stale byte inside a block cut short, keep the page as allocated
+ 		if (order < pool->min_order || order > pool->max_order ||
+ 		    (page & (npages - 1)) != 0 || page + npages > pool->num_pages)
+ 		{
+ 			state[page] = pool->min_order;
+ 			npages = 1;
+ 		}
+ 		else if (state[page] & PAGE_FREE)
+ 		{
+ 			addFreeBlock(pool, page, order, (state[page] & PAGE_RELEASED) != 0);
+ 			page += npages;
+ 			continue;
+ 		}
+
+ 		//exact fit blocks keep more than half of their pages
+ 		unsigned long kept = PAGE_KEPT(pool, page);
+ 		if (kept > npages / 2 && kept < npages)
+ 		{
+ 			npages = kept;
+ 		}
+ 		else
+ 		{
+ 			PAGE_KEPT(pool, page) = 0;
+ 		}
+ 		if (PAGE_SLACK(pool, page) >= npages << pool->min_order)
+ 		{
+ 			PAGE_SLACK(pool, page) = 0;
+ 		}
+
+ 		pool->used += npages << pool->min_order;
+ 		pool->allocated += npages << pool->min_order;
+ 		pool->requested += requestedSize(pool, page);
+ 		page += npages;
+ 	}
+
+ 	notePeak(pool);
+ 	//buddies freed one by one never merge in an eager pool
+ 	if (pool->lazy_high == 0)
+ 	{
+ 		coalesceAll(pool);
+ 	}
+ }
+
+
+/**
+ * Fill in the default configuration of a pool
+ *
+ * @param config configuration to initialize
+ * @param size size of the arena in bytes
+ * @param min_order order of the smallest block (the page size)
+ */
+void buddy_pool_config_init(buddy_pool_config_t *config, size_t size, int min_order)
+{
+	config->size = size;
+	config->min_order = min_order;
+	config->release_order = 0;
+	config->release_lazily = 0;
+	config->cache_max_order = 0;
+	config->cache_size = 32;
+	config->slab = 0;
+	config->exact_fit = 0;
+	config->lazy_high_watermark = 0;
+	config->lazy_low_watermark = -1;
+}
+
+/**
+ * Create a buddy pool
+ *
+ * @param size size of the arena in bytes
+ * @param min_order order of the smallest block (the page size)
+ * @return new pool, or NULL if the arguments are invalid or out of memory
+ * @see buddy_pool_create_config
+ */
+buddy_pool_t *buddy_pool_create(size_t size, int min_order)
+{
+	buddy_pool_config_t config;
+
+	buddy_pool_config_init(&config, size, min_order);
+	return buddy_pool_create_config(&config);
+}
+
+/**
+ * Create a buddy pool from a configuration
+ *
+ * The size is rounded down to a multiple of the page size. It does not need to
+ * be a power of two: the arena is seeded with the largest aligned blocks that
+ * cover it, and blocks whose buddy would lie past the end never coalesce.
+ *
+ * The arena is an anonymous mapping aligned to its largest block, so every
+ * block is aligned to its own size. Memory is only committed when it is first
+ * touched, which makes it cheap to reserve arenas far larger than what is
+ * live at any time.
+ *
+ * Page metadata takes 9 bytes per page: a state byte and two 32-bit free list
+ * links, which limits a pool to 2^32 - 1 pages. It lives in a mapping of its
+ * own that starts out zeroed, where a zero state means a page is neither free
+ * nor allocated, so creating a pool takes the same time whatever its size.
+ *
+ * @param config pool configuration
+ * @return new pool, or NULL if the configuration is invalid or out of memory
+ */
+buddy_pool_t *buddy_pool_create_config(const buddy_pool_config_t *config)
+{
+	buddy_pool_t *pool = calloc(1, sizeof(buddy_pool_t));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	if (!configurePool(pool, config))
+	{
+		free(pool);
+		return NULL;
+	}
+
+	// aligned to the largest block so every block is aligned to its size
+	char *memory = mapAligned(pool->size, 0, 1UL<<pool->max_order, -1);
+	if (memory == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->memory_offset = (intptr_t)memory - (intptr_t)pool;
+
+	// the metadata is mapped the same way, zero filled pages are only
+	// faulted in once allocations reach the part of the arena they describe
+	char *metadata = mmap(NULL, pool->num_pages * PAGE_METADATA, PROT_READ | PROT_WRITE,
+	                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (metadata == MAP_FAILED)
+	{
+		munmap(memory, pool->size);
+		free(pool);
+		return NULL;
+	}
+	placeMetadata(pool, metadata);
+
+#if USE_THREADS == 1
+	pthread_mutex_init(&pool->lock, NULL);
+	INIT_LIST_HEAD(&pool->caches);
+	if (pool->cache_max_order >= 0 &&
+	    pthread_key_create(&pool->cache_key, destroyThreadCache) != 0)
+	{
+		pool->cache_max_order = -1;
+	}
+#endif
+
+	//the pages start out neither free nor allocated
+	seedPool(pool);
+	return pool;
+}
+
+/**
+ * Create a pool in a named shared memory segment
+ *
+ * The pool, its page metadata and its arena all live in a POSIX shared memory
+ * object (see shm_open) that other processes attach to with
+ * buddy_pool_open_shared, wherever they map it: the pool only refers to its
+ * metadata and arena by offsets, and the free lists link pages by index.
+ * Blocks are passed between processes as offsets, see buddy_pool_offset.
+ *
+ * The pool lock is process-shared and robust. When a process dies holding
+ * it, the next process to lock the pool rebuilds the free lists and byte
+ * counts from the page state bytes before going on, see buddy_pool_open_file.
+ * A block that was being split or merged at the time may be lost.
+ *
+ * Shared pools have no slabs and no thread caches, which are linked through
+ * pointers, and give released memory back with MADV_REMOVE.
+ *
+ * @param name name of the segment, e.g. "/buddy", which must not exist yet
+ * @param config pool configuration, with slab and cache_max_order left 0
+ * @return new pool, or NULL if the configuration is invalid, the segment
+ * exists or cannot be created, or the allocator is built without threads
+ */
+buddy_pool_t *buddy_pool_create_shared(const char *name, const buddy_pool_config_t *config)
+{
+#if USE_THREADS == 1
+	buddy_pool_t shape;
+
+	memset(&shape, 0, sizeof(shape));
+	if (config->slab || config->cache_max_order > 0 || !configurePool(&shape, config))
+	{
+		return NULL;
+	}
+
+	size_t arenaOffset;
+	size_t length = segmentLength(&shape, &arenaOffset);
+	char *segment = NULL;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (ftruncate(fd, length) == 0)
+	{
+		segment = mapAligned(length, arenaOffset, 1UL<<shape.max_order, fd);
+	}
+	close(fd);
+	if (segment == NULL)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	buddy_pool_t *pool = placePool(segment, &shape, length, arenaOffset);
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&pool->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	publishSegment(segment, pool, arenaOffset, SHARED_MAGIC);
+	return pool;
+#else
+	return NULL;
+#endif
+}
+
+/**
+ * Attach to a pool created by buddy_pool_create_shared
+ *
+ * @param name name of the segment
+ * @return the pool, or NULL if the segment does not exist or holds no pool
+ */
+buddy_pool_t *buddy_pool_open_shared(const char *name)
+{
+	char *segment;
+	int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	segment = mapSegment(fd, SHARED_MAGIC);
+	close(fd);
+
+	return segment != NULL ? (buddy_pool_t *)(segment + SHARED_POOL_OFFSET) : NULL;
+}
+
+/**
+ * Remove the name of a shared pool
+ *
+ * Processes that have the pool open keep using it, the memory is freed once
+ * the last of them destroys its handle.
+ *
+ * @param name name of the segment
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int buddy_pool_unlink_shared(const char *name)
+{
+	return shm_unlink(name);
+}
+
+/**
+ * Get the offset of a block in its pool's arena, which stays the same in
+ * every process attached to a shared pool
+ *
+ * @param pool pool the block belongs to
+ * @param addr memory block address
+ * @return offset of the block
+ */
+size_t buddy_pool_offset(buddy_pool_t *pool, void *addr)
+{
+	return (char *)addr - POOL_MEMORY(pool);
+}
+
+/**
+ * Get the address of a block from its offset, see buddy_pool_offset
+ *
+ * @param pool pool the block belongs to
+ * @param offset offset of the block
+ * @return memory block address in the calling process
+ */
+void *buddy_pool_address(buddy_pool_t *pool, size_t offset)
+{
+	return POOL_MEMORY(pool) + offset;
+}
+
+/**
+ * Create a pool in a file, to be reopened by later runs of the program
+ *
+ * The pool, its page metadata and its arena are laid out in the file the same
+ * way as in a shared memory segment, see buddy_pool_create_shared, and the
+ * file is mapped shared so the pool works directly on the page cache. Nothing
+ * needs to be reloaded on restart: buddy_pool_open_file maps the file again
+ * and the pool carries on where it was left, at whatever address the file is
+ * mapped this time. buddy_pool_set_root records where the caller's own data
+ * starts.
+ *
+ * The file is locked (see flock) while the pool is open, so one process at a
+ * time uses it. buddy_pool_destroy writes it back and marks it clean.
+ *
+ * File pools have no slabs and no thread caches, which are linked through
+ * pointers, and punch released blocks out of the file with MADV_REMOVE.
+ *
+ * @param path file to create, which must not exist yet. The file is sparse,
+ * only the blocks that get written take up disk space.
+ * @param config pool configuration, with slab and cache_max_order left 0
+ * @return new pool, or NULL if the configuration is invalid or the file
+ * exists or cannot be created
+ */
+buddy_pool_t *buddy_pool_create_file(const char *path, const buddy_pool_config_t *config)
+{
+	buddy_pool_t shape;
+
+	memset(&shape, 0, sizeof(shape));
+	if (config->slab || config->cache_max_order > 0 || !configurePool(&shape, config))
+	{
+		return NULL;
+	}
+
+	size_t arenaOffset;
+	size_t length = segmentLength(&shape, &arenaOffset);
+	char *segment = NULL;
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0 && ftruncate(fd, length) == 0)
+	{
+		segment = mapAligned(length, arenaOffset, 1UL<<shape.max_order, fd);
+	}
+	if (segment == NULL)
+	{
+		unlink(path);
+		close(fd);
+		return NULL;
+	}
+
+	buddy_pool_t *pool = placePool(segment, &shape, length, arenaOffset);
+	shared_header_t *header = (shared_header_t *)segment;
+
+	pool->file_fd = fd;
+#if USE_THREADS == 1
+	pthread_mutex_init(&pool->lock, NULL);
+#endif
+	header->generation = 1;
+	header->clean = 0;
+
+	//the pool reaches the disk before the magic that makes it valid
+	msync(segment, arenaOffset, MS_SYNC);
+	publishSegment(segment, pool, arenaOffset, FILE_MAGIC);
+	msync(segment, SHARED_PAGE_SIZE, MS_SYNC);
+	return pool;
+}
+
+/**
+ * Reopen a pool created by buddy_pool_create_file
+ *
+ * Every open bumps the generation number in the file header, and a clean
+ * close records the generation it closes. If the two differ on open, the
+ * last process to use the pool died with it open and the free lists may be
+ * halfway through an update, so they are rebuilt from the page state bytes,
+ * walking the blocks once. Otherwise opening the pool costs a mapping and a
+ * header write, whatever its size.
+ *
+ * Recovery covers the process going away. After a crash of the system the
+ * file holds whatever the kernel had written back by then, which is only
+ * known to be consistent if the pool was closed cleanly.
+ *
+ * @param path file holding the pool
+ * @param recovered set to whether the pool had to be recovered, may be NULL
+ * @return the pool, or NULL if the file does not hold a pool, was made by an
+ * incompatible build, is shorter than its header says or describes a shape
+ * it cannot hold, or is open in another process
+ */
+buddy_pool_t *buddy_pool_open_file(const char *path, int *recovered)
+{
+	char *segment = NULL;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+	{
+		segment = mapSegment(fd, FILE_MAGIC);
+	}
+	if (segment == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	shared_header_t *header = (shared_header_t *)segment;
+	buddy_pool_t *pool = (buddy_pool_t *)(segment + SHARED_POOL_OFFSET);
+	int dirty = header->clean != header->generation;
+
+	//from here on a crash shows up as a generation that was never closed
+	header->generation++;
+	msync(segment, SHARED_PAGE_SIZE, MS_SYNC);
+
+	pool->file_fd = fd;
+#if USE_THREADS == 1
+	pthread_mutex_init(&pool->lock, NULL); //whatever state the last process left it in
+#endif
+	if (dirty)
+	{
+		recoverPool(pool);
+	}
+	if (recovered != NULL)
+	{
+		*recovered = dirty;
+	}
+	return pool;
+}
+
+/**
+ * Record the block the rest of the caller's data hangs off, so it can be
+ * found again once a file or shared pool is reopened
+ *
+ * @param pool pool the block belongs to
+ * @param addr memory block address, NULL to clear the root
+ */
+void buddy_pool_set_root(buddy_pool_t *pool, void *addr)
+{
+	pool->root = addr != NULL ? buddy_pool_offset(pool, addr) + 1 : 0;
+}
+
+/**
+ * Get the block recorded by buddy_pool_set_root
+ *
+ * @param pool pool to read
+ * @return memory block address in the calling process, NULL if none is set
+ */
+void *buddy_pool_root(buddy_pool_t *pool)
+{
+	return pool->root != 0 ? buddy_pool_address(pool, pool->root - 1) : NULL;
+}
+
+/**
+ * Destroy a buddy pool and release its arena
+ *
+ * Every block allocated from the pool becomes invalid. No other thread may be
+ * using the pool.
+ *
+ * For a shared pool only the calling process's mapping goes away, the pool
+ * lives on in the segment until it is unlinked and every process has let go
+ * of it. A file pool is written back to its file and marked clean, so the
+ * next buddy_pool_open_file skips recovery.
+ *
+ * @param pool pool to destroy, may be NULL
+ */
+void buddy_pool_destroy(buddy_pool_t *pool)
+{
+	if (pool == NULL)
+	{
+		return;
+	}
+	if (pool->shared_length != 0)
+	{
+		char *segment = (char *)pool - SHARED_POOL_OFFSET;
+		int fd = pool->file_fd;
+
+		if (fd != -1)
+		{
+			shared_header_t *header = (shared_header_t *)segment;
+
+			//the pool reaches the disk before the mark that it is clean
+			pool->file_fd = -1;
+			msync(segment, pool->shared_length, MS_SYNC);
+			header->clean = header->generation;
+			msync(segment, SHARED_PAGE_SIZE, MS_SYNC);
+		}
+		munmap(segment, pool->shared_length);
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return;
+	}
+
+#if USE_THREADS == 1
+	if (pool->cache_max_order >= 0)
+	{
+		thread_cache_t *cache, *next;
+
+		pthread_key_delete(pool->cache_key);
+		list_for_each_entry_safe(cache, next, &pool->caches, list)
+		{
+			free(cache);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+#endif
+
+	munmap(POOL_NEXT(pool), pool->num_pages * PAGE_METADATA);
+	munmap(POOL_MEMORY(pool), pool->size);
+	free(pool);
+}
+
+/**
+ * Allocate a memory block.
+ *
+ * On a memory request, the allocator returns the head of a free-list of the
+ * matching size (i.e., smallest block that satisfies the request). If the
+ * free-list of the matching block size is empty, then a larger block size will
+ * be selected. The selected (large) block is then splitted into two smaller
+ * blocks. Among the two blocks, left block will be used for allocation or be
+ * further splitted while the right block will be added to the appropriate
+ * free-list.
+ *
+ * Small blocks are served from the calling thread's cache when the pool has
+ * one, without taking the pool lock. A request the free lists cannot satisfy
+ * first drains the calling thread's cache back into them and tries again.
+ * Pools with slabs enabled serve requests of up to 2K from a slab of the
+ * matching size class instead.
+ *
+ * Pools in exact fit mode keep only the pages the request needs and return
+ * the power of two pieces of the unused tail to the free lists right away.
+ *
+ * @param pool pool to allocate from
+ * @param size size in bytes
+ * @return memory block address
+ */
+void *buddy_pool_alloc(buddy_pool_t *pool, size_t size)
+{
+#if USE_HISTOGRAM == 1
+	op_counts_t before = g_op_counts;
+	uint64_t start = readTimestamp();
+	void *addr = allocFromPool(pool, size);
+
+	recordLatency(BUDDY_HIST_ALLOC, determineOrder(pool, size), start, &before);
+	return addr;
+#else
+	return allocFromPool(pool, size);
+#endif
+}
+
+/**
+ * Free an allocated memory block.
+ *
+ * Whenever a block is freed, the allocator checks its buddy. If the buddy is
+ * free as well, then the two buddies are combined to form a bigger block. This
+ * process continues until one of the buddies is not free.
+ *
+ * If the resulting block reaches the pool's release order, the pieces of it
+ * that are still backed by memory are given back to the OS.
+ *
+ * Small blocks go to the calling thread's cache when the pool has one and are
+ * only merged once the cache drains them.
+ *
+ * @param pool pool the block was allocated from
+ * @param addr memory block address to be freed, may be NULL
+ */
+void buddy_pool_free(buddy_pool_t *pool, void *addr)
+{
+#if USE_HISTOGRAM == 1
+	if (addr == NULL)
+	{
+		return;
+	}
+
+	int order = traceOrder(pool, addr);
+	op_counts_t before = g_op_counts;
+	uint64_t start = readTimestamp();
+
+	freeToPool(pool, addr);
+	recordLatency(BUDDY_HIST_FREE, order, start, &before);
+#else
+	freeToPool(pool, addr);
+#endif
+}
+
+/**
+ * Allocate a memory block with a given alignment.
+ *
+ * Blocks are aligned to their own size, and slab objects to their size class
+ * up to the 64 byte slab header. The request is padded up to the alignment,
+ * and alignments past 64 bytes skip the slabs of pools that have them.
+ *
+ * @param pool pool to allocate from
+ * @param size size in bytes
+ * @param align alignment in bytes, a power of two
+ * @return memory block address, or NULL if align is not a power of two or
+ * the request cannot be satisfied
+ */
+void *buddy_pool_alloc_aligned(buddy_pool_t *pool, size_t size, size_t align)
+{
+	if (align == 0 || (align & (align - 1)) != 0)
+	{
+		return NULL;
+	}
+	if (pool->slab && align > SLAB_HEADER && size <= SLAB_MAX_SIZE)
+	{
+		size = SLAB_MAX_SIZE + 1;
+	}
+	if (size < align)
+	{
+		size = align;
+	}
+	return buddy_pool_alloc(pool, size);
+}
+
+/**
+ * Allocate several blocks of the same size at once.
+ *
+ * The blocks are carved out of as few free blocks as possible: each one is
+ * taken off its free list once, cut into pieces of the requested order, and
+ * only the unused tail goes back to the free lists. The whole batch is served
+ * under a single lock.
+ *
+ * @param pool pool to allocate from
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated, less than n if the pool ran out
+ */
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, size_t size, int n, void **out)
+{
+	int got = 0;
+
+	if (pool->slab && size <= SLAB_MAX_SIZE &&
+	    pool->slab_order[slabClass(size)] != -1)
+	{
+		LOCK_POOL(pool);
+		while (got < n && (out[got] = slabAlloc(pool, slabClass(size))) != NULL)
+		{
+			got++;
+		}
+		UNLOCK_POOL(pool);
+		TRACE_BATCH(pool, BUDDY_TRACE_ALLOC, out, got, size);
+		return got;
+	}
+
+	int order = determineOrder(pool, size);
+
+	if (order == -1)
+	{
+		return 0;
+	}
+
+	LOCK_POOL(pool);
+	while (got < n)
+	{
+		int need = n - got;
+		//the order of a block that holds all remaining pieces
+		int want = order + (need > 1 ? 64 - __builtin_clzl(need - 1) : 0);
+		unsigned long candidates;
+		int k;
+
+		if (want > pool->max_order)
+		{
+			want = pool->max_order;
+		}
+
+		//the smallest block holding everything, or else the largest there is
+		if ((candidates = pool->free_mask & (~0UL << want)) != 0)
+		{
+			k = __builtin_ctzl(candidates);
+		}
+		else if ((candidates = pool->free_mask & (~0UL << order)) != 0)
+		{
+			k = 63 - __builtin_clzl(candidates);
+		}
+		else if (pool->lazy_high > 0 && coalesceAll(pool) > 0)
+		{
+			continue;
+		}
+#if USE_THREADS == 1
+		else if (drainThreadCache(pool) > 0)
+		{
+			continue;
+		}
+#endif
+		else
+		{
+			break; //there was not enough memory available
+		}
+
+		unsigned long page = pool->free_area[k];
+		unsigned long start = page << pool->min_order;
+		int released = removeFreeBlock(pool, page);
+		int take = need;
+
+		if ((k - order) < 31 && take > (1 << (k - order)))
+		{
+			take = 1 << (k - order);
+		}
+
+		for (int i = 0; i < take; i++)
+		{
+			unsigned long piece = page + ((unsigned long)i << (order - pool->min_order));
+
+			POOL_STATE(pool)[piece] = order;
+			PAGE_KEPT(pool, piece) = 0;
+			setRequested(pool, piece, size);
+			out[got++] = PAGE_TO_ADDR(pool, piece);
+		}
+		pool->used += 1UL << k;
+		pool->allocated += (unsigned long)take << order;
+		pool->requested += take * size;
+		addFreeRange(pool, start + ((unsigned long)take << order), start + (1UL << k), released);
+	}
+	notePeak(pool);
+	UNLOCK_POOL(pool);
+
+	TRACE_BATCH(pool, BUDDY_TRACE_ALLOC, out, got, size);
+	return got;
+}
+
+/**
+ * Free several blocks at once.
+ *
+ * The addresses are sorted first so that blocks of the batch that are buddies
+ * of each other are merged before they reach the free lists, then what is left
+ * is coalesced with the free lists as usual, all under a single lock. Blocks
+ * bypass the thread caches.
+ *
+ * @param pool pool the blocks were allocated from
+ * @param addrs block addresses, NULL entries are skipped. The array is used as
+ * scratch space and its contents are unspecified on return.
+ * @param n number of addresses
+ */
+void buddy_pool_free_bulk(buddy_pool_t *pool, void **addrs, int n)
+{
+	int top = 0; //addrs[0..top) is a stack of merged blocks
+
+#if USE_TRACE == 1
+	//the batch is traced up front since it clobbers addrs, except for its
+	//last block whose event carries the merges of the whole batch
+	void *last = NULL;
+	int lastOrder = -1;
+
+	if (TRACING())
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (addrs[i] != NULL)
+			{
+				if (last != NULL)
+				{
+					traceEvent(BUDDY_TRACE_FREE, last, 0, lastOrder);
+				}
+				last = addrs[i];
+				lastOrder = traceOrder(pool, last);
+			}
+		}
+	}
+#endif
+
+	qsort(addrs, n, sizeof(void*), compareAddresses);
+
+	LOCK_POOL(pool);
+	for (int i = 0; i < n; i++)
+	{
+		if (addrs[i] == NULL)
+		{
+			continue;
+		}
+
+		unsigned long page = ADDR_TO_PAGE(pool, addrs[i]);
+
+		if (POOL_STATE(pool)[page] & PAGE_SLAB)
+		{
+			slabFree(pool, page, addrs[i]);
+			continue;
+		}
+
+		pool->allocated -= blockSize(pool, page);
+		pool->requested -= requestedSize(pool, page);
+		if (PAGE_KEPT(pool, page) != 0)
+		{
+			//trimmed blocks go back piece by piece, as in buddy_pool_free
+			freeRange(pool, page << pool->min_order, (page << pool->min_order) + blockSize(pool, page));
+			continue;
+		}
+
+		addrs[top++] = addrs[i];
+
+		//after sorting, buddies within the batch end up next to each other
+		while (top >= 2)
+		{
+			unsigned long left = ADDR_TO_PAGE(pool, addrs[top - 2]);
+			unsigned long right = ADDR_TO_PAGE(pool, addrs[top - 1]);
+			int o = PAGE_ORDER(pool, left);
+
+			if (PAGE_ORDER(pool, right) != o || o >= pool->max_order ||
+			    BUDDY_PAGE(pool, left, o) != right)
+			{
+				break;
+			}
+
+			POOL_STATE(pool)[left] = o + 1;
+			pool->nr_merges++;
+			COUNT_OP(merges);
+			top--;
+		}
+	}
+
+	for (int i = 0; i < top; i++)
+	{
+		freeBlock(pool, ADDR_TO_PAGE(pool, addrs[i]));
+	}
+	UNLOCK_POOL(pool);
+
+#if USE_TRACE == 1
+	if (last != NULL)
+	{
+		traceEvent(BUDDY_TRACE_FREE, last, 0, lastOrder);
+	}
+#endif
+}
+
+/**
+ * Resize an allocated memory block.
+ *
+ * A block grows in place when the buddies it would absorb are free, and
+ * shrinks in place by freeing the halves split off its tail. Only when
+ * neither works is a new block allocated and the contents copied. Blocks
+ * trimmed in exact fit mode can only shrink in place.
+ *
+ * @param pool pool the block was allocated from
+ * @param addr memory block address, NULL behaves like buddy_pool_alloc
+ * @param size new size in bytes, 0 frees the block
+ * @return address of the resized block, or NULL if the request cannot be
+ * satisfied, in which case the original block is left untouched
+ */
+void *buddy_pool_realloc(buddy_pool_t *pool, void *addr, size_t size)
+{
+	if (addr == NULL)
+	{
+		return buddy_pool_alloc(pool, size);
+	}
+	if (size == 0)
+	{
+		buddy_pool_free(pool, addr);
+		return NULL;
+	}
+
+	unsigned long page = ADDR_TO_PAGE(pool, addr);
+	unsigned long kept = PAGE_KEPT(pool, page);
+	size_t oldSize;
+
+	if (POOL_STATE(pool)[page] & PAGE_SLAB)
+	{
+		int sizeClass = slabOf(pool, page, addr)->size_class;
+
+		//objects stay put while the new size maps to the same class
+		oldSize = 1UL << (sizeClass + SLAB_MIN_SHIFT);
+		if (size <= SLAB_MAX_SIZE && slabClass(size) == sizeClass)
+		{
+			TRACE(BUDDY_TRACE_REALLOC, addr, size, PAGE_ORDER(pool, page));
+			return addr;
+		}
+	}
+	else
+	{
+		int orderNeeded = determineOrder(pool, size);
+		unsigned long pagesNeeded = (size + PAGE_SIZE(pool) - 1) >> pool->min_order;
+		int resized = 0;
+
+		if (orderNeeded == -1)
+		{
+			return NULL;
+		}
+		oldSize = kept != 0 ? kept << pool->min_order : 1UL << PAGE_ORDER(pool, page);
+
+		LOCK_POOL(pool);
+		pool->allocated -= oldSize;
+		pool->requested -= requestedSize(pool, page);
+		if (orderNeeded == PAGE_ORDER(pool, page) && kept == 0 && !pool->exact_fit)
+		{
+			resized = 1;
+		}
+		else if (kept != 0)
+		{
+			//a trimmed block can only give pages back
+			if (pagesNeeded <= kept)
+			{
+				unsigned long start = page << pool->min_order;
+
+				freeRange(pool, start + (pagesNeeded << pool->min_order), start + oldSize);
+				POOL_STATE(pool)[page] = orderNeeded;
+				PAGE_KEPT(pool, page) = pagesNeeded == 1UL << (orderNeeded - pool->min_order) ? 0 : pagesNeeded;
+				resized = 1;
+			}
+		}
+		else if (orderNeeded <= PAGE_ORDER(pool, page))
+		{
+			shrinkBlock(pool, page, orderNeeded);
+			resized = 1;
+		}
+		else
+		{
+			resized = growBlock(pool, page, orderNeeded);
+		}
+
+		if (resized && pool->exact_fit && PAGE_KEPT(pool, page) == 0 &&
+		    PAGE_ORDER(pool, page) > pool->cache_max_order)
+		{
+			trimBlock(pool, page, pagesNeeded);
+		}
+		if (resized)
+		{
+			setRequested(pool, page, size);
+			notePeak(pool);
+		}
+		pool->allocated += blockSize(pool, page);
+		pool->requested += requestedSize(pool, page);
+		UNLOCK_POOL(pool);
+
+		if (resized)
+		{
+			TRACE(BUDDY_TRACE_REALLOC, addr, size, PAGE_ORDER(pool, page));
+			return addr;
+		}
+	}
+
+	void *moved = buddy_pool_alloc(pool, size);
+
+	if (moved != NULL)
+	{
+		memcpy(moved, addr, oldSize < size ? oldSize : size);
+		buddy_pool_free(pool, addr);
+	}
+	return moved;
+}
+
+/**
+ * Get the usable size of an allocated block
+ *
+ * This is the size the block was granted: its size class for slab objects,
+ * the pages it kept for exact fit blocks, and its whole block otherwise.
+ *
+ * @param pool pool to look the block up in
+ * @param addr memory block address
+ * @return usable size in bytes, 0 if addr is NULL or outside the pool's arena
+ */
+size_t buddy_pool_usable_size(buddy_pool_t *pool, void *addr)
+{
+	if (addr == NULL || (char *)addr < POOL_MEMORY(pool) ||
+	    (char *)addr >= POOL_MEMORY(pool) + pool->size)
+	{
+		return 0;
+	}
+
+	unsigned long page = ADDR_TO_PAGE(pool, addr);
+
+	if (POOL_STATE(pool)[page] & PAGE_SLAB)
+	{
+		return 1UL << (slabOf(pool, page, addr)->size_class + SLAB_MIN_SHIFT);
+	}
+	return blockSize(pool, page);
+}
+
+/**
+ * Take the lock of a pool, holding off every other thread's calls into it
+ *
+ * Meant for fork(): a child only has the forking thread, so a lock held by
+ * another thread at the time would never be released. Taking the lock
+ * before the fork and releasing it in both processes afterwards (see
+ * pthread_atfork) leaves the child a consistent, unlocked pool. The caller
+ * must not call into the pool while holding the lock.
+ *
+ * @param pool pool to lock
+ */
+void buddy_pool_lock(buddy_pool_t *pool)
+{
+	LOCK_POOL(pool);
+}
+
+/**
+ * Release the lock taken by buddy_pool_lock
+ *
+ * @param pool pool to unlock
+ */
+void buddy_pool_unlock(buddy_pool_t *pool)
+{
+	UNLOCK_POOL(pool);
+}
+
+/**
+ * Read the statistics of a pool
+ *
+ * Every figure is kept up to date as blocks come and go, so this takes
+ * constant time and never walks a free list. The thread caches keep their
+ * own allocation counters, which are summed here.
+ *
+ * @param pool pool to read
+ * @param stats receives the statistics
+ */
+void buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	LOCK_POOL(pool);
+	stats->splits = pool->nr_splits;
+	stats->merges = pool->nr_merges;
+	stats->min_order = pool->min_order;
+	stats->max_order = pool->max_order;
+	for (int o = pool->min_order; o <= pool->max_order; o++)
+	{
+		stats->free_blocks[o] = pool->free_count[o];
+	}
+	stats->bytes_free = pool->size - pool->used;
+	stats->bytes_used = pool->used;
+	stats->peak_used = pool->peak_used;
+	if (pool->free_mask != 0)
+	{
+		stats->largest_free = 1UL << (63 - __builtin_clzl(pool->free_mask));
+	}
+
+	//the shares of the thread caches may wrap on their own, but not summed
+	unsigned long allocated = pool->allocated;
+	unsigned long requested = pool->requested;
+#if USE_THREADS == 1
+	thread_cache_t *cache;
+
+	if (pool->cache_max_order >= 0)
+	{
+		list_for_each_entry(cache, &pool->caches, list)
+		{
+			allocated += __atomic_load_n(&cache->allocated, __ATOMIC_RELAXED);
+			requested += __atomic_load_n(&cache->requested, __ATOMIC_RELAXED);
+		}
+	}
+#endif
+	UNLOCK_POOL(pool);
+
+	stats->bytes_allocated = allocated;
+	stats->bytes_requested = requested;
+}
+
+/**
+ * Print the buddy system status---order oriented
+ *
+ * print number of free pages in each order.
+ *
+ * @param pool pool to print
+ */
+void buddy_pool_dump(buddy_pool_t *pool)
+{
+	struct buddy_stats stats;
+	int o;
+
+	buddy_pool_get_stats(pool, &stats);
+	for (o = stats.min_order; o <= stats.max_order; o++) {
+		printf("%lu:%luK ", stats.free_blocks[o], (1UL<<o)/1024);
+	}
+	printf("\n");
+}
+
+/**
+ * Turn tracing on or off
+ *
+ * While tracing is on, every alloc, free and in place realloc of every pool
+ * is recorded in a ring of the calling thread, without taking any lock. Each
+ * event holds a time stamp counter reading, the block, the requested size,
+ * its order and the splits and merges the call made. The first event of a
+ * thread after tracing is turned on also counts the splits and merges the
+ * thread made while it was off.
+ *
+ * Tracing is only compiled in with USE_TRACE. While it is off, the cost of a
+ * call is one predictable branch.
+ *
+ * @param enable nonzero to record events
+ * @return whether tracing was on before, -1 if it is not compiled in
+ */
+int buddy_trace_enable(int enable)
+{
+#if USE_TRACE == 1
+	return __atomic_exchange_n(&g_trace_enabled, enable != 0, __ATOMIC_RELAXED);
+#else
+	(void)enable;
+	return -1;
+#endif
+}
+
+/**
+ * Move recorded events out of the thread rings
+ *
+ * Events come out ring by ring, each ring in the order it was written. Sort
+ * them by timestamp to interleave threads. A full ring drops new events until
+ * it is drained. The rings of threads that have exited are freed once they
+ * are empty.
+ *
+ * @param events receives the events
+ * @param max room in events
+ * @param dropped if not NULL, receives the number of events dropped since the
+ * last drain
+ * @return number of events drained
+ */
+size_t buddy_trace_drain(struct buddy_trace_event *events, size_t max, unsigned long *dropped)
+{
+	size_t n = 0;
+	unsigned long lost = 0;
+
+#if USE_TRACE == 1
+	trace_ring_t *ring, *next;
+
+	pthread_mutex_lock(&g_trace_lock);
+	list_for_each_entry_safe(ring, next, &g_trace_rings, list)
+	{
+		//an exited thread cannot add events once it is seen to be gone
+		int exited = __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE);
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned long tail = ring->tail;
+		unsigned long total = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+		for (; tail != head && n < max; tail++)
+		{
+			events[n++] = ring->events[tail & (TRACE_RING_SIZE - 1)];
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		lost += total - ring->reported;
+		ring->reported = total;
+
+		if (exited && tail == head)
+		{
+			list_del(&ring->list);
+			free(ring);
+		}
+	}
+	pthread_mutex_unlock(&g_trace_lock);
+#else
+	(void)events;
+	(void)max;
+#endif
+
+	if (dropped != NULL)
+	{
+		*dropped = lost;
+	}
+	return n;
+}
+
+/**
+ * Sum the latency histograms of every thread.
+ *
+ * Each thread records into its own histograms without any locking, so this
+ * can be called while other threads allocate; their calls in flight may or
+ * may not be counted. Threads that exited still count.
+ *
+ * @param op one of buddy_hist_op
+ * @param order order to report, -1 for all orders
+ * @param outcome one of buddy_hist_outcome, -1 for all outcomes
+ * @param hist receives the histogram
+ * @return 0, or -1 if op is invalid or buddy.c was built without USE_HISTOGRAM
+ */
+int buddy_histogram_get(int op, int order, int outcome, struct buddy_histogram *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->ns_per_tick = 1.0;
+
+#if USE_HISTOGRAM == 1
+	if (op < 0 || op >= BUDDY_HIST_OPS || order >= BUDDY_MAX_ORDERS || outcome >= BUDDY_HIST_OUTCOMES)
+	{
+		return -1;
+	}
+
+	hist_local_t *local;
+
+	pthread_mutex_lock(&g_hist_lock);
+	sumHistograms(&g_hist_exited, op, order, outcome, hist);
+	list_for_each_entry(local, &g_hist_threads, list)
+	{
+		sumHistograms(local, op, order, outcome, hist);
+	}
+	pthread_mutex_unlock(&g_hist_lock);
+
+	hist->ns_per_tick = nsPerTick();
+	return 0;
+#else
+	(void)op;
+	(void)order;
+	(void)outcome;
+	return -1;
+#endif
+}
+
+/**
+ * Clear the latency histograms of every thread.
+ *
+ * A thread recording while they are cleared may keep a few of its counts.
+ */
+void buddy_histogram_reset(void)
+{
+#if USE_HISTOGRAM == 1
+	hist_local_t *local;
+
+	pthread_mutex_lock(&g_hist_lock);
+	clearHistograms(&g_hist_exited);
+	list_for_each_entry(local, &g_hist_threads, list)
+	{
+		clearHistograms(local);
+	}
+	pthread_mutex_unlock(&g_hist_lock);
+#endif
+}
+
+/**
+ * Add a histogram to another one, for instance to combine several orders.
+ *
+ * @param into histogram added to
+ * @param from histogram to add
+ */
+void buddy_histogram_merge(struct buddy_histogram *into, const struct buddy_histogram *from)
+{
+	into->count += from->count;
+	into->total += from->total;
+	into->max = from->max > into->max ? from->max : into->max;
+	if (into->ns_per_tick == 0)
+	{
+		into->ns_per_tick = from->ns_per_tick;
+	}
+	for (int i = 0; i < BUDDY_HIST_BUCKETS; i++)
+	{
+		into->buckets[i] += from->buckets[i];
+	}
+}
+
+/**
+ * Record a latency in a histogram, for callers timing their own operations.
+ *
+ * @param hist histogram to add to
+ * @param ticks latency in the unit of the histogram, set ns_per_tick to match
+ */
+void buddy_histogram_add(struct buddy_histogram *hist, uint64_t ticks)
+{
+	hist->buckets[histBucket(ticks)]++;
+	hist->count++;
+	hist->total += ticks;
+	if (ticks > hist->max)
+	{
+		hist->max = ticks;
+	}
+}
+
+/**
+ * Read a percentile off a histogram.
+ *
+ * The result is the highest latency of the bucket the percentile falls in,
+ * so it overstates the exact value by less than 1/2^BUDDY_HIST_SUB_BITS.
+ *
+ * @param hist histogram to read
+ * @param percentile between 0 and 100, e.g. 99.9
+ * @return latency in nanoseconds, 0 if the histogram is empty
+ */
+double buddy_histogram_percentile(const struct buddy_histogram *hist, double percentile)
+{
+	uint64_t rank = percentile / 100 * hist->count + 0.5;
+	uint64_t seen = 0;
+
+	if (hist->count == 0)
+	{
+		return 0;
+	}
+	if (rank == 0)
+	{
+		rank = 1;
+	}
+
+	for (int i = 0; i < BUDDY_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen >= rank)
+		{
+			uint64_t highest = i;
+
+			if (i >= (1 << BUDDY_HIST_SUB_BITS))
+			{
+				int shift = (i >> BUDDY_HIST_SUB_BITS) - 1;
+				uint64_t mantissa = (i & ((1 << BUDDY_HIST_SUB_BITS) - 1)) + (1 << BUDDY_HIST_SUB_BITS);
+
+				highest = ((mantissa + 1) << shift) - 1;
+			}
+			return (highest < hist->max ? highest : hist->max) * hist->ns_per_tick;
+		}
+	}
+
+	return hist->max * hist->ns_per_tick;
+}
+
+/**
+ * Initialize the buddy system
+ *
+ * (Re)creates the default pool of 2^MAX_ORDER bytes with 2^MIN_ORDER byte
+ * pages.
+ */
+void buddy_init()
+{
+	buddy_pool_destroy(g_default_pool);
+	g_default_pool = buddy_pool_create(1UL<<MAX_ORDER, MIN_ORDER);
+}
+
+/**
+ * Allocate a memory block from the default pool.
+ *
+ * @param size size in bytes
+ * @return memory block address, or NULL if the request cannot be satisfied
+ */
+void *buddy_alloc(int size)
+{
+	if (g_default_pool == NULL)
+	{
+		return NULL;
+	}
+
+	return buddy_pool_alloc(g_default_pool, size < 0 ? 0 : size);
+}
+
+/**
+ * Free a memory block allocated from the default pool.
+ *
+ * @param addr memory block address to be freed
+ */
+void buddy_free(void *addr)
+{
+	buddy_pool_free(g_default_pool, addr);
+}
+
+/**
+ * Allocate several blocks of the same size from the default pool.
+ *
+ * @param size size in bytes of every block
+ * @param n number of blocks wanted
+ * @param out receives the block addresses
+ * @return number of blocks allocated
+ * @see buddy_pool_alloc_bulk
+ */
+int buddy_alloc_bulk(int size, int n, void *out[])
+{
+	if (g_default_pool == NULL)
+	{
+		return 0;
+	}
+
+	return buddy_pool_alloc_bulk(g_default_pool, size < 0 ? 0 : size, n, out);
+}
+
+/**
+ * Free several blocks allocated from the default pool.
+ *
+ * @param addrs block addresses, clobbered on return
+ * @param n number of addresses
+ * @see buddy_pool_free_bulk
+ */
+void buddy_free_bulk(void *addrs[], int n)
+{
+	buddy_pool_free_bulk(g_default_pool, addrs, n);
+}
+
+/**
+ * Resize a memory block allocated from the default pool.
+ *
+ * @param addr memory block address
+ * @param new_size new size in bytes
+ * @return address of the resized block, or NULL if it cannot be resized
+ * @see buddy_pool_realloc
+ */
+void *buddy_realloc(void *addr, int new_size)
+{
+	if (g_default_pool == NULL)
+	{
+		return NULL;
+	}
+
+	return buddy_pool_realloc(g_default_pool, addr, new_size < 0 ? 0 : new_size);
+}
+
+/**
+ * Read the statistics of the default pool.
+ *
+ * @param stats receives the statistics
+ * @see buddy_pool_get_stats
+ */
+void buddy_get_stats(struct buddy_stats *stats)
+{
+	if (g_default_pool == NULL)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	buddy_pool_get_stats(g_default_pool, stats);
+}
+
+/**
+ * Print the status of the default pool.
+ */
+void buddy_dump()
+{
+	buddy_pool_dump(g_default_pool);
 }
@@ -1,9 +1,170 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* number of free lists in a pool, orders must fit in an unsigned long mask */
+#define BUDDY_MAX_ORDERS 64
+
+/* latency histogram shape: every power of two range of ticks is split into
+ * 2^BUDDY_HIST_SUB_BITS linear buckets, up to 2^BUDDY_HIST_MAX_SHIFT ticks */
+#define BUDDY_HIST_SUB_BITS 4
+#define BUDDY_HIST_MAX_SHIFT 40
+#define BUDDY_HIST_BUCKETS ((BUDDY_HIST_MAX_SHIFT - BUDDY_HIST_SUB_BITS + 1) << BUDDY_HIST_SUB_BITS)
+
+/**
+ * Handle to an independent buddy heap
+ */
+typedef struct buddy_pool buddy_pool_t;
+
+/**
+ * Options of a pool, fill in the defaults with buddy_pool_config_init
+ */
+typedef struct buddy_pool_config {
+	size_t size;        ///< size of the arena in bytes
+	int min_order;      ///< order of the smallest block (the page size)
+	int release_order;  ///< free blocks of this order or larger give their memory back to the OS, 0 never does (default)
+	int release_lazily; ///< release with MADV_FREE instead of MADV_DONTNEED where supported
+	int cache_max_order; ///< blocks up to this order are cached per thread, 0 disables the caches (default)
+	int cache_size;     ///< blocks of each order a thread cache holds, refilled and drained half at a time
+	int slab;           ///< carve requests of up to 2K out of slabs of 16-2048 byte objects instead of whole pages
+	int exact_fit;      ///< keep only the pages a request needs and free the rest of its block right away
+	int lazy_high_watermark; ///< leave freed blocks unmerged until an order has more free blocks than this, 0 merges eagerly (default)
+	int lazy_low_watermark;  ///< free blocks a coalescing pass leaves at an order, negative for half the high watermark (default)
+} buddy_pool_config_t;
+
+/**
+ * Pool statistics, see buddy_pool_get_stats
+ *
+ * Used bytes are everything off the free lists, including blocks held by
+ * thread caches and the unused room of slabs. Allocated and requested bytes
+ * only count live allocations: what they were granted and what they asked
+ * for, the difference being internal fragmentation.
+ */
+struct buddy_stats {
+	unsigned long splits; ///< blocks split in two
+	unsigned long merges; ///< buddy pairs merged into one block
+	int min_order;        ///< order of the smallest block
+	int max_order;        ///< order of the largest block
+	unsigned long free_blocks[BUDDY_MAX_ORDERS]; ///< free blocks per order, from min_order to max_order
+	size_t bytes_free;    ///< bytes on the free lists
+	size_t bytes_used;    ///< bytes off the free lists
+	size_t peak_used;     ///< highest bytes_used so far
+	size_t largest_free;  ///< size of the largest free block, 0 if there is none
+	size_t bytes_allocated; ///< bytes granted to live allocations
+	size_t bytes_requested; ///< bytes asked for by live allocations
+};
+
+/**
+ * Kinds of traced calls
+ */
+enum buddy_trace_type {
+	BUDDY_TRACE_ALLOC = 1, ///< buddy_pool_alloc, or a block of buddy_pool_alloc_bulk
+	BUDDY_TRACE_FREE,      ///< buddy_pool_free, or a block of buddy_pool_free_bulk
+	BUDDY_TRACE_REALLOC    ///< buddy_pool_realloc that resized in place, moves show up as an alloc and a free
+};
+
+/**
+ * A traced call, see buddy_trace_drain
+ */
+struct buddy_trace_event {
+	uint64_t timestamp; ///< time stamp counter when the call finished
+	uint64_t addr;      ///< block allocated, freed or resized, 0 if an allocation failed
+	uint64_t size;      ///< bytes requested, 0 for frees
+	uint8_t type;       ///< one of buddy_trace_type
+	int8_t order;       ///< order of the block, or of the slab for slab objects, -1 on failure
+	uint16_t splits;    ///< blocks split by the call
+	uint16_t merges;    ///< buddy pairs merged by the call
+	uint16_t thread;    ///< number of the thread that made the call
+};
+
+/**
+ * Calls with a latency histogram
+ */
+enum buddy_hist_op {
+	BUDDY_HIST_ALLOC,  ///< buddy_pool_alloc, by the order of the request
+	BUDDY_HIST_FREE,   ///< buddy_pool_free, by the order of the block
+	BUDDY_HIST_OPS
+};
+
+/**
+ * What a timed call had to do, the first that applies
+ */
+enum buddy_hist_outcome {
+	BUDDY_HIST_HIT,    ///< served by the thread cache without taking the pool lock
+	BUDDY_HIST_MISS,   ///< took the pool lock but split and merged nothing
+	BUDDY_HIST_SPLIT,  ///< split at least one block
+	BUDDY_HIST_MERGE,  ///< merged at least one buddy pair
+	BUDDY_HIST_OUTCOMES
+};
+
+/**
+ * Log-linear latency histogram, see buddy_histogram_get. Latencies are in
+ * time stamp ticks: the first 2^BUDDY_HIST_SUB_BITS buckets are one tick wide,
+ * after that every power of two range is split into that many equal buckets.
+ * Histograms of the same process add up bucket by bucket.
+ */
+struct buddy_histogram {
+	uint64_t count;     ///< calls recorded
+	uint64_t total;     ///< sum of their latencies
+	uint64_t max;       ///< slowest call
+	double ns_per_tick; ///< length of a tick
+	uint64_t buckets[BUDDY_HIST_BUCKETS]; ///< calls per latency bucket
+};
+
+void buddy_pool_config_init(buddy_pool_config_t *config, size_t size, int min_order);
+buddy_pool_t *buddy_pool_create_config(const buddy_pool_config_t *config);
+buddy_pool_t *buddy_pool_create(size_t size, int min_order);
+void buddy_pool_destroy(buddy_pool_t *pool);
+buddy_pool_t *buddy_pool_create_shared(const char *name, const buddy_pool_config_t *config);
+buddy_pool_t *buddy_pool_open_shared(const char *name);
+int buddy_pool_unlink_shared(const char *name);
+size_t buddy_pool_offset(buddy_pool_t *pool, void *addr);
+void *buddy_pool_address(buddy_pool_t *pool, size_t offset);
+buddy_pool_t *buddy_pool_create_file(const char *path, const buddy_pool_config_t *config);
+buddy_pool_t *buddy_pool_open_file(const char *path, int *recovered);
+void buddy_pool_set_root(buddy_pool_t *pool, void *addr);
+void *buddy_pool_root(buddy_pool_t *pool);
+void *buddy_pool_alloc(buddy_pool_t *pool, size_t size);
+void *buddy_pool_alloc_aligned(buddy_pool_t *pool, size_t size, size_t align);
+void buddy_pool_free(buddy_pool_t *pool, void *addr);
+void *buddy_pool_realloc(buddy_pool_t *pool, void *addr, size_t size);
+size_t buddy_pool_usable_size(buddy_pool_t *pool, void *addr);
+void buddy_pool_lock(buddy_pool_t *pool);
+void buddy_pool_unlock(buddy_pool_t *pool);
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, size_t size, int n, void **out);
+void buddy_pool_free_bulk(buddy_pool_t *pool, void **addrs, int n);
+void buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_stats *stats);
+void buddy_pool_dump(buddy_pool_t *pool);
+
+/* tracing, only recorded when buddy.c is built with USE_TRACE */
+int buddy_trace_enable(int enable);
+size_t buddy_trace_drain(struct buddy_trace_event *events, size_t max, unsigned long *dropped);
+
+/* latency histograms, only recorded when buddy.c is built with USE_HISTOGRAM */
+int buddy_histogram_get(int op, int order, int outcome, struct buddy_histogram *hist);
+void buddy_histogram_reset(void);
+void buddy_histogram_merge(struct buddy_histogram *into, const struct buddy_histogram *from);
+void buddy_histogram_add(struct buddy_histogram *hist, uint64_t ticks);
+double buddy_histogram_percentile(const struct buddy_histogram *hist, double percentile);
+
+/* wrappers over the default pool */
 void buddy_init();
 void *buddy_alloc(int size);
 void buddy_free(void *addr);
+void *buddy_realloc(void *addr, int new_size);
+int buddy_alloc_bulk(int size, int n, void *out[]);
+void buddy_free_bulk(void *addrs[], int n);
+void buddy_get_stats(struct buddy_stats *stats);
 void buddy_dump();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // BUDDY_H
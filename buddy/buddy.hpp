@@ -0,0 +1,200 @@
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "buddy.h"
+
+/*
+ * C++ adapters over buddy pools. buddy_memory_resource lets the std::pmr
+ * containers draw their memory from a pool, BuddyAllocator<T> does the same
+ * for containers that take an allocator type.
+ *
+ *     buddy_memory_resource resource(1UL << 30);
+ *     std::pmr::unordered_map<int, std::pmr::string> map(&resource);
+ *     std::vector<int, BuddyAllocator<int>> vector(BuddyAllocator<int>(&resource));
+ *
+ * Both throw std::bad_alloc when the pool runs out.
+ */
+
+/**
+ * A std::pmr::memory_resource serving blocks from a buddy pool
+ */
+class buddy_memory_resource : public std::pmr::memory_resource {
+public:
+	/**
+	 * Serve blocks from an existing pool, which must outlive the resource
+	 */
+	explicit buddy_memory_resource(buddy_pool_t* pool) noexcept
+		: pool_(pool), owned_(false)
+	{
+	}
+
+	/**
+	 * Serve blocks from a pool of its own, created from a configuration
+	 *
+	 * @throws std::bad_alloc if the pool cannot be created
+	 */
+	explicit buddy_memory_resource(const buddy_pool_config_t& config)
+		: pool_(buddy_pool_create_config(&config)), owned_(true)
+	{
+		if (pool_ == nullptr)
+			throw std::bad_alloc();
+	}
+
+	/**
+	 * Serve blocks from a pool of its own
+	 *
+	 * @param size Size of the arena in bytes
+	 * @param min_order Order of the smallest block, 4K pages by default
+	 * @param slab Serve requests of up to 2K from slabs, as container nodes
+	 * are mostly small
+	 * @throws std::bad_alloc if the pool cannot be created
+	 */
+	explicit buddy_memory_resource(std::size_t size, int min_order = 12, bool slab = true)
+		: pool_(nullptr), owned_(true)
+	{
+		buddy_pool_config_t config;
+
+		buddy_pool_config_init(&config, size, min_order);
+		config.slab = slab;
+
+		if ((pool_ = buddy_pool_create_config(&config)) == nullptr)
+			throw std::bad_alloc();
+	}
+
+	buddy_memory_resource(const buddy_memory_resource&) = delete;
+	buddy_memory_resource& operator=(const buddy_memory_resource&) = delete;
+
+	/**
+	 * Destroy the pool if the resource created it, every block it served
+	 * becomes invalid
+	 */
+	~buddy_memory_resource() override
+	{
+		if (owned_)
+			buddy_pool_destroy(pool_);
+	}
+
+	/**
+	 * The pool blocks are served from
+	 */
+	buddy_pool_t* pool() const noexcept
+	{
+		return pool_;
+	}
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void* addr = buddy_pool_alloc_aligned(pool_, bytes, alignment);
+
+		if (addr == nullptr)
+			throw std::bad_alloc();
+
+		return addr;
+	}
+
+	void do_deallocate(void* addr, std::size_t, std::size_t) override
+	{
+		buddy_pool_free(pool_, addr);
+	}
+
+	/**
+	 * Resources are interchangeable when they serve the same pool
+	 */
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		const buddy_memory_resource* buddy = dynamic_cast<const buddy_memory_resource*>(&other);
+
+		return buddy != nullptr && buddy->pool_ == pool_;
+	}
+
+private:
+	buddy_pool_t* pool_; ///< Pool blocks are served from
+	bool owned_;         ///< Destroy the pool with the resource
+};
+
+/**
+ * An allocator serving objects from a buddy pool, for containers that take
+ * an allocator type rather than a memory resource. Copies and rebound copies
+ * share the pool.
+ */
+template <typename T>
+class BuddyAllocator {
+public:
+	using value_type = T;
+
+	/**
+	 * Serve objects from a pool, which must outlive every copy
+	 */
+	explicit BuddyAllocator(buddy_pool_t* pool) noexcept
+		: pool_(pool)
+	{
+	}
+
+	/**
+	 * Serve objects from the pool of a resource
+	 */
+	explicit BuddyAllocator(const buddy_memory_resource* resource) noexcept
+		: pool_(resource->pool())
+	{
+	}
+
+	template <typename U>
+	BuddyAllocator(const BuddyAllocator<U>& other) noexcept
+		: pool_(other.pool())
+	{
+	}
+
+	/**
+	 * Allocate room for count objects
+	 *
+	 * @throws std::bad_alloc if the pool runs out
+	 */
+	T* allocate(std::size_t count)
+	{
+		void* addr;
+
+		if (count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+
+		if ((addr = buddy_pool_alloc_aligned(pool_, count * sizeof(T), alignof(T))) == nullptr)
+			throw std::bad_alloc();
+
+		return static_cast<T*>(addr);
+	}
+
+	void deallocate(T* addr, std::size_t) noexcept
+	{
+		buddy_pool_free(pool_, addr);
+	}
+
+	/**
+	 * The pool objects are served from
+	 */
+	buddy_pool_t* pool() const noexcept
+	{
+		return pool_;
+	}
+
+private:
+	buddy_pool_t* pool_; ///< Pool objects are served from
+};
+
+template <typename T, typename U>
+bool operator==(const BuddyAllocator<T>& a, const BuddyAllocator<U>& b) noexcept
+{
+	return a.pool() == b.pool();
+}
+
+template <typename T, typename U>
+bool operator!=(const BuddyAllocator<T>& a, const BuddyAllocator<U>& b) noexcept
+{
+	return a.pool() != b.pool();
+}
+
+#endif // BUDDY_HPP
@@ -0,0 +1,302 @@
+#ifndef BUDDY_ARENA_HPP
+#define BUDDY_ARENA_HPP
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+#include <sys/mman.h>
+
+/*
+ * A buddy arena whose shape is fixed at compile time. Where buddy.c keeps the
+ * orders of a pool in variables and shifts by them on every call, here the
+ * page size, the number of pages, the order of every size class and the size
+ * of the metadata are constants, so each instantiation compiles to straight
+ * line code and arenas of different shapes cost nothing extra side by side:
+ *
+ *     BuddyArena<12, 20> small;                       // 1 MiB of 4K pages
+ *     auto* big = new BuddyArena<16, 32, BuddyMutex>; // 4 GiB of 64K pages, shared by threads
+ *     void* header = small.allocate<64>();            // order picked at compile time
+ *
+ * The metadata is a byte and two page links per page, held in fixed size
+ * arrays inside the object, so arenas with many pages belong on the heap.
+ * The arena itself is an anonymous mapping aligned to its size, only
+ * committed as it is touched, unless a buffer is handed in.
+ */
+
+/**
+ * Lock policy of arenas used by a single thread
+ */
+struct BuddyNoLock {
+	void lock() noexcept {}
+	void unlock() noexcept {}
+};
+
+/**
+ * Lock policy of arenas shared between threads
+ */
+using BuddyMutex = std::mutex;
+
+template <int MinOrder, int MaxOrder, typename LockPolicy = BuddyNoLock>
+class BuddyArena : private LockPolicy {
+	static_assert(MinOrder >= 0 && MinOrder <= MaxOrder, "orders out of range");
+	static_assert(MaxOrder < 64 && MaxOrder - MinOrder < 32, "too many pages");
+
+public:
+	static constexpr int min_order = MinOrder;
+	static constexpr int max_order = MaxOrder;
+	static constexpr int num_orders = MaxOrder - MinOrder + 1;
+	static constexpr std::size_t page_size = std::size_t(1) << MinOrder;
+	static constexpr std::size_t arena_size = std::size_t(1) << MaxOrder;
+	static constexpr std::size_t num_pages = std::size_t(1) << (MaxOrder - MinOrder);
+
+	/**
+	 * Size of the blocks of every order, from MinOrder up
+	 */
+	static constexpr std::array<std::size_t, num_orders> block_sizes = [] {
+		std::array<std::size_t, num_orders> sizes{};
+
+		for (int o = 0; o < num_orders; ++o)
+			sizes[o] = page_size << o;
+		return sizes;
+	}();
+
+	/**
+	 * Order of the smallest block that holds a request
+	 *
+	 * @param size Size in bytes
+	 * @return The order, or -1 if the request is larger than the arena
+	 */
+	static constexpr int order_of(std::size_t size) noexcept
+	{
+		if (size <= page_size)
+			return MinOrder;
+		if (size > arena_size)
+			return -1;
+		return int(sizeof(unsigned long long) * CHAR_BIT) - __builtin_clzll(size - 1);
+	}
+
+	/**
+	 * Map an arena of its own
+	 *
+	 * @throws std::bad_alloc if the memory cannot be mapped
+	 */
+	BuddyArena()
+		: memory_(map_arena()), mapped_(true)
+	{
+		if (memory_ == nullptr)
+			throw std::bad_alloc();
+		reset();
+	}
+
+	/**
+	 * Carve blocks out of a buffer, which must be arena_size bytes long,
+	 * aligned to arena_size and outlive the arena
+	 */
+	explicit BuddyArena(void* buffer) noexcept
+		: memory_(static_cast<char*>(buffer)), mapped_(false)
+	{
+		reset();
+	}
+
+	BuddyArena(const BuddyArena&) = delete;
+	BuddyArena& operator=(const BuddyArena&) = delete;
+
+	~BuddyArena()
+	{
+		if (mapped_)
+			munmap(memory_, arena_size);
+	}
+
+	/**
+	 * Free every block at once
+	 */
+	void reset() noexcept
+	{
+		state_.fill(0);
+		free_head_.fill(none);
+		free_mask_ = 0;
+		push(0, num_orders - 1);
+	}
+
+	/**
+	 * Allocate a block, aligned to its size
+	 *
+	 * @param size Size in bytes
+	 * @return The block, nullptr if no block is large enough
+	 */
+	void* allocate(std::size_t size) noexcept
+	{
+		int order = order_of(size);
+
+		return order != -1 ? allocate_order(order - MinOrder) : nullptr;
+	}
+
+	/**
+	 * Allocate a block whose order is known at compile time
+	 */
+	template <std::size_t Size>
+	void* allocate() noexcept
+	{
+		constexpr int order = order_of(Size);
+
+		static_assert(order != -1, "request larger than the arena");
+		return allocate_order(order - MinOrder);
+	}
+
+	/**
+	 * Free a block, merging it with its buddies while they are free
+	 *
+	 * @param addr Block returned by allocate, may be nullptr
+	 */
+	void deallocate(void* addr) noexcept
+	{
+		if (addr == nullptr)
+			return;
+
+		std::size_t page = page_of(addr);
+
+		std::lock_guard<LockPolicy> guard(*this);
+		int order = state_[page] & order_mask;
+
+		for (; order < num_orders - 1; ++order) {
+			std::size_t buddy = page ^ (std::size_t(1) << order);
+
+			if (state_[buddy] != (free_flag | order))
+				break;
+
+			remove(buddy, order);
+			state_[page | buddy] = 0;
+			page &= buddy;
+		}
+		push(page, order);
+	}
+
+	/**
+	 * Size of the block holding an address
+	 */
+	std::size_t usable_size(void* addr) const noexcept
+	{
+		return page_size << (state_[page_of(addr)] & order_mask);
+	}
+
+	/**
+	 * Check if an address lies inside the arena
+	 */
+	bool owns(const void* addr) const noexcept
+	{
+		return static_cast<const char*>(addr) >= memory_ &&
+		       static_cast<const char*>(addr) < memory_ + arena_size;
+	}
+
+	/**
+	 * Number of free blocks of an order, walks its free list
+	 */
+	std::size_t free_blocks(int order) noexcept
+	{
+		std::lock_guard<LockPolicy> guard(*this);
+		std::size_t count = 0;
+
+		for (index_t page = free_head_[order - MinOrder]; page != none; page = next_[page])
+			++count;
+		return count;
+	}
+
+private:
+	/* the narrowest type numbering every page, with one value to spare */
+	using index_t = std::conditional_t<(num_pages < UINT16_MAX), uint16_t, uint32_t>;
+
+	static constexpr index_t none = index_t(-1);  // ends a free list
+	static constexpr unsigned char order_mask = 0x3f; // order of a block head, less MinOrder
+	static constexpr unsigned char free_flag = 0x40;  // the block head is on a free list
+
+	/**
+	 * Map the arena aligned to its size, over-reserving and trimming
+	 */
+	static char* map_arena() noexcept
+	{
+		std::size_t reserve = 2 * arena_size;
+		void* mapping = mmap(nullptr, reserve, PROT_READ | PROT_WRITE,
+		                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (mapping == MAP_FAILED)
+			return nullptr;
+
+		char* start = static_cast<char*>(mapping);
+		char* memory = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(start) + arena_size - 1) &
+		                                       ~uintptr_t(arena_size - 1));
+
+		if (memory > start)
+			munmap(start, memory - start);
+		if (memory + arena_size < start + reserve)
+			munmap(memory + arena_size, start + reserve - memory - arena_size);
+		return memory;
+	}
+
+	std::size_t page_of(const void* addr) const noexcept
+	{
+		return std::size_t(static_cast<const char*>(addr) - memory_) >> MinOrder;
+	}
+
+	/**
+	 * Take a block of an order, relative to MinOrder, splitting a larger one
+	 * if its free list is empty
+	 */
+	void* allocate_order(int order) noexcept
+	{
+		std::lock_guard<LockPolicy> guard(*this);
+		uint64_t candidates = free_mask_ >> order;
+
+		if (candidates == 0)
+			return nullptr;
+
+		int found = order + __builtin_ctzll(candidates);
+		index_t page = free_head_[found];
+
+		remove(page, found);
+		while (found > order) {
+			--found;
+			push(page + (std::size_t(1) << found), found);
+		}
+		state_[page] = order;
+
+		return memory_ + (std::size_t(page) << MinOrder);
+	}
+
+	void push(std::size_t page, int order) noexcept
+	{
+		index_t head = free_head_[order];
+
+		next_[page] = head;
+		prev_[page] = none;
+		if (head != none)
+			prev_[head] = page;
+		free_head_[order] = page;
+		free_mask_ |= uint64_t(1) << order;
+		state_[page] = free_flag | order;
+	}
+
+	void remove(std::size_t page, int order) noexcept
+	{
+		if (prev_[page] != none)
+			next_[prev_[page]] = next_[page];
+		else if ((free_head_[order] = next_[page]) == none)
+			free_mask_ &= ~(uint64_t(1) << order);
+		if (next_[page] != none)
+			prev_[next_[page]] = prev_[page];
+	}
+
+	char* memory_;     ///< arena the blocks are carved from
+	bool mapped_;      ///< unmap the arena with the object
+	uint64_t free_mask_; ///< bit o is set while free_head_[o] is not empty
+	std::array<index_t, num_orders> free_head_; ///< first page of every free list
+	std::array<unsigned char, num_pages> state_; ///< order and free flag of block heads, 0 elsewhere
+	std::array<index_t, num_pages> next_;        ///< free list links by page
+	std::array<index_t, num_pages> prev_;
+};
+
+#endif // BUDDY_ARENA_HPP
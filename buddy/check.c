@@ -0,0 +1,1115 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/*
+ * Correctness checks of the pool API, run by make test next to the
+ * simulator traces. Every check builds pools of its own and verifies the
+ * statistics after each step: the used and free bytes cover the arena, the
+ * free lists add up to the free bytes, live allocations never ask for more
+ * than they were granted, and a pool whose blocks are all freed is back to
+ * the blocks it started with.
+ */
+#define CHECK_MIN_ORDER 12
+#define CHECK_PAGE_SIZE (1UL << CHECK_MIN_ORDER)
+#define CHECK_ARENA (1UL << 22)   // pool of most checks, 1024 pages
+#define CHECK_BLOCKS 8            // blocks a child process hands over
+#define CHECK_THREADS 8           // threads swapping blocks in the threads check
+#define CHECK_SWAPS 20000         // blocks each of them allocates
+#define CHECK_SLOTS 64            // blocks in flight between them
+#define CHECK_FILL 256            // bytes of each of them filled and checked
+#define CHECK_SLAB_CLASSES 8      // slab size classes, 16 to 2048 bytes
+#define CHECK_THREAD_ARENA (1UL << 26) // room for the caches of all of them
+
+/**
+ * A single check
+ */
+typedef struct check_t {
+	const char* name;        ///< Name used to select the check
+	const char* description; ///< One line summary printed by -l
+	void (*run)(void);       ///< Runs the check, failures go through expect
+} check_t;
+
+
+static int failures;            // Failed expectations of the running check
+static const char* check_step;  // What the running check is doing, for messages
+
+
+/**
+ * Record an expectation, reporting it if it does not hold
+ */
+#define expect(cond) expect_at(cond, #cond, __LINE__)
+
+static void expect_at(bool cond, const char* text, int line)
+{
+	if (cond)
+		return;
+
+	printf("  FAILED line %d: %s (%s)\n", line, text, check_step);
+	++failures;
+}
+
+/**
+ * Create a pool for a check
+ *
+ * @param size Size of the arena in bytes
+ * @param setup Changes the default configuration, may be NULL
+ */
+static buddy_pool_t* make_pool(size_t size, void (*setup)(buddy_pool_config_t*))
+{
+	buddy_pool_config_t config;
+	buddy_pool_t* pool;
+
+	buddy_pool_config_init(&config, size, CHECK_MIN_ORDER);
+	if (setup != NULL)
+		setup(&config);
+
+	if ((pool = buddy_pool_create_config(&config)) == NULL) {
+		fprintf(stderr, "ERROR: Failed to create a pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return pool;
+}
+
+/**
+ * Check the statistics of a pool against each other
+ *
+ * @param pool Pool to check, with no slabs in use
+ * @param size Bytes the pool manages
+ * @param step What the check is doing, for messages
+ * @return The statistics
+ */
+static struct buddy_stats check_stats(buddy_pool_t* pool, size_t size, const char* step)
+{
+	struct buddy_stats stats;
+	size_t listed = 0;
+	size_t largest = 0;
+
+	check_step = step;
+	buddy_pool_get_stats(pool, &stats);
+
+	for (int o = stats.min_order; o <= stats.max_order; ++o) {
+		listed += stats.free_blocks[o] << o;
+		if (stats.free_blocks[o] != 0)
+			largest = 1UL << o;
+	}
+
+	expect(stats.bytes_used + stats.bytes_free == size);
+	expect(listed == stats.bytes_free);
+	expect(largest == stats.largest_free);
+	expect(stats.bytes_requested <= stats.bytes_allocated);
+	expect(stats.bytes_allocated <= stats.bytes_used);
+	expect(stats.peak_used >= stats.bytes_used);
+
+	return stats;
+}
+
+/**
+ * Check that a pool whose blocks are all freed has coalesced back into a
+ * single block of its power of two arena
+ */
+static void check_coalesced(buddy_pool_t* pool, size_t size, const char* step)
+{
+	struct buddy_stats stats = check_stats(pool, size, step);
+	unsigned long blocks = 0;
+
+	for (int o = stats.min_order; o <= stats.max_order; ++o)
+		blocks += stats.free_blocks[o];
+
+	expect(stats.bytes_used == 0);
+	expect(stats.bytes_allocated == 0);
+	expect(stats.bytes_requested == 0);
+	expect(blocks == 1 && stats.largest_free == size);
+}
+
+/**
+ * Fill a block with a pattern derived from a seed
+ */
+static void fill(void* addr, size_t size, unsigned seed)
+{
+	for (size_t i = 0; i < size; ++i)
+		((unsigned char*) addr)[i] = (unsigned char) (seed + i * 7);
+}
+
+/**
+ * Check that a block still holds the pattern fill wrote
+ */
+static bool holds(const void* addr, size_t size, unsigned seed)
+{
+	for (size_t i = 0; i < size; ++i)
+		if (((const unsigned char*) addr)[i] != (unsigned char) (seed + i * 7))
+			return false;
+
+	return true;
+}
+
+
+/**
+ * buddy_pool_realloc grows in place into free buddies, moves when they are
+ * taken, shrinks in place, and keeps the contents every time
+ */
+static void check_realloc(void)
+{
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, NULL);
+	char* block = buddy_pool_alloc(pool, CHECK_PAGE_SIZE);
+	char* grown;
+	char* moved;
+	char* blocker;
+	char* shrunk;
+
+	fill(block, CHECK_PAGE_SIZE, 1);
+	check_stats(pool, CHECK_ARENA, "one page allocated");
+
+	// the right hand buddies of a fresh block are free
+	grown = buddy_pool_realloc(pool, block, 4 * CHECK_PAGE_SIZE);
+	check_stats(pool, CHECK_ARENA, "grown in place");
+	expect(grown == block);
+	expect(buddy_pool_usable_size(pool, grown) == 4 * CHECK_PAGE_SIZE);
+	expect(holds(grown, CHECK_PAGE_SIZE, 1));
+
+	// a block right after it stops it from growing in place
+	fill(grown, 4 * CHECK_PAGE_SIZE, 2);
+	blocker = buddy_pool_alloc(pool, 4 * CHECK_PAGE_SIZE);
+	fill(blocker, 4 * CHECK_PAGE_SIZE, 3);
+	expect(blocker == grown + 4 * CHECK_PAGE_SIZE);
+	moved = buddy_pool_realloc(pool, grown, 16 * CHECK_PAGE_SIZE);
+	check_stats(pool, CHECK_ARENA, "grown by moving");
+	expect(moved != NULL && moved != grown);
+	expect(holds(moved, 4 * CHECK_PAGE_SIZE, 2));
+	expect(holds(blocker, 4 * CHECK_PAGE_SIZE, 3));
+
+	// shrinking frees the tail and keeps the head
+	fill(moved, 16 * CHECK_PAGE_SIZE, 4);
+	shrunk = buddy_pool_realloc(pool, moved, 3 * CHECK_PAGE_SIZE);
+	check_stats(pool, CHECK_ARENA, "shrunk in place");
+	expect(shrunk == moved);
+	expect(buddy_pool_usable_size(pool, shrunk) == 4 * CHECK_PAGE_SIZE);
+	expect(holds(shrunk, 3 * CHECK_PAGE_SIZE, 4));
+
+	// requests the arena cannot hold leave the block alone
+	expect(buddy_pool_realloc(pool, shrunk, 2 * CHECK_ARENA) == NULL);
+	expect(holds(shrunk, 3 * CHECK_PAGE_SIZE, 4));
+
+	// NULL allocates, 0 frees
+	block = buddy_pool_realloc(pool, NULL, 100);
+	expect(block != NULL);
+	expect(buddy_pool_realloc(pool, block, 0) == NULL);
+
+	buddy_pool_free(pool, shrunk);
+	buddy_pool_free(pool, blocker);
+	check_coalesced(pool, CHECK_ARENA, "realloc blocks freed");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Compare addresses for qsort
+ */
+static int compare_addresses(const void* a, const void* b)
+{
+	const char* x = *(char* const*) a;
+	const char* y = *(char* const*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * buddy_pool_alloc_bulk hands out distinct aligned blocks and stops when the
+ * pool runs out, buddy_pool_free_bulk coalesces them back into one block
+ */
+static void check_bulk(void)
+{
+	enum { FIRST = 100, ALL = CHECK_ARENA / (2 * CHECK_PAGE_SIZE) };
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, NULL);
+	void* blocks[ALL + 1];
+	void* sorted[ALL];
+	struct buddy_stats stats;
+	bool apart = true;
+	int got;
+
+	// 5000 bytes take 8K blocks, the tails of split blocks go back at once
+	got = buddy_pool_alloc_bulk(pool, 5000, FIRST, blocks);
+	stats = check_stats(pool, CHECK_ARENA, "first batch allocated");
+	expect(got == FIRST);
+	expect(stats.bytes_allocated == FIRST * 2 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_requested == FIRST * 5000UL);
+	expect(stats.bytes_used == stats.bytes_allocated);
+
+	// a batch larger than what is left gets everything there is
+	got += buddy_pool_alloc_bulk(pool, 2 * CHECK_PAGE_SIZE, ALL - FIRST + 1, blocks + FIRST);
+	stats = check_stats(pool, CHECK_ARENA, "pool exhausted");
+	expect(got == ALL);
+	expect(stats.bytes_free == 0);
+
+	memcpy(sorted, blocks, sizeof(sorted));
+	qsort(sorted, ALL, sizeof(void*), compare_addresses);
+	for (int i = 0; i < ALL; ++i) {
+		apart &= ((uintptr_t) sorted[i] & (2 * CHECK_PAGE_SIZE - 1)) == 0;
+		if (i > 0)
+			apart &= (char*) sorted[i] - (char*) sorted[i - 1] >= (ptrdiff_t) (2 * CHECK_PAGE_SIZE);
+	}
+	check_step = "pool exhausted";
+	expect(apart);
+
+	// every other block one at a time, the rest as a batch with a hole
+	for (int i = 0; i < ALL; i += 2) {
+		buddy_pool_free(pool, blocks[i]);
+		blocks[i] = NULL;
+	}
+	check_stats(pool, CHECK_ARENA, "half freed one by one");
+	buddy_pool_free_bulk(pool, blocks, ALL);
+	check_coalesced(pool, CHECK_ARENA, "rest freed as a batch");
+
+	// pages in batches, freed as a batch and then one by one
+	got = buddy_pool_alloc_bulk(pool, CHECK_PAGE_SIZE, ALL, blocks);
+	got += buddy_pool_alloc_bulk(pool, CHECK_PAGE_SIZE, ALL, sorted);
+	check_stats(pool, CHECK_ARENA, "pages allocated");
+	expect(got == 2 * ALL);
+	buddy_pool_free_bulk(pool, blocks, ALL);
+	check_stats(pool, CHECK_ARENA, "first half freed as a batch");
+	buddy_pool_free_bulk(pool, sorted, 0);
+	check_stats(pool, CHECK_ARENA, "empty batch freed");
+	for (int i = ALL - 1; i >= 0; --i)
+		buddy_pool_free(pool, sorted[i]);
+	check_coalesced(pool, CHECK_ARENA, "second half freed one by one");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Lazy coalescing with a high watermark of 8 and a low one of 4
+ */
+static void setup_lazy(buddy_pool_config_t* config)
+{
+	config->lazy_high_watermark = 8;
+	config->lazy_low_watermark = 4;
+}
+
+/**
+ * A lazy pool drains every order back under the high watermark as blocks are
+ * freed, and merges everything when a request needs it
+ */
+static void check_lazy(void)
+{
+	enum { PAGES = CHECK_ARENA / CHECK_PAGE_SIZE };
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, setup_lazy);
+	static void* pages[PAGES];
+	struct buddy_stats stats;
+	unsigned long most = 0;
+	void* whole;
+
+	for (int i = 0; i < PAGES; ++i)
+		pages[i] = buddy_pool_alloc(pool, CHECK_PAGE_SIZE);
+	stats = check_stats(pool, CHECK_ARENA, "every page allocated");
+	expect(stats.bytes_free == 0);
+
+	for (int i = 0; i < PAGES; ++i) {
+		buddy_pool_free(pool, pages[i]);
+		stats = check_stats(pool, CHECK_ARENA, "pages being freed");
+		for (int o = stats.min_order; o <= stats.max_order; ++o)
+			if (stats.free_blocks[o] > most)
+				most = stats.free_blocks[o];
+	}
+	expect(most <= 8);
+	expect(stats.bytes_used == 0);
+	expect(stats.largest_free < CHECK_ARENA); // some pieces were left unmerged
+
+	// the remaining pieces merge on demand for a request of the whole arena
+	whole = buddy_pool_alloc(pool, CHECK_ARENA);
+	check_stats(pool, CHECK_ARENA, "whole arena allocated");
+	expect(whole != NULL);
+	buddy_pool_free(pool, whole);
+	check_coalesced(pool, CHECK_ARENA, "whole arena freed");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Exact fit mode
+ */
+static void setup_exact_fit(buddy_pool_config_t* config)
+{
+	config->exact_fit = 1;
+}
+
+/**
+ * Exact fit keeps only the pages a request needs, lists the rest of the block
+ * as free, and gets the whole block back on free
+ */
+static void check_exact_fit(void)
+{
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, setup_exact_fit);
+	struct buddy_stats stats;
+	char* blocks[3];
+	char* moved;
+
+	// 80K out of a 128K block, 20K out of a 32K one
+	blocks[0] = buddy_pool_alloc(pool, 20 * CHECK_PAGE_SIZE);
+	blocks[1] = buddy_pool_alloc(pool, 5 * CHECK_PAGE_SIZE - 100);
+	stats = check_stats(pool, CHECK_ARENA, "trimmed blocks allocated");
+	expect(buddy_pool_usable_size(pool, blocks[0]) == 20 * CHECK_PAGE_SIZE);
+	expect(buddy_pool_usable_size(pool, blocks[1]) == 5 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_used == 25 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_allocated == 25 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_requested == 25 * CHECK_PAGE_SIZE - 100);
+
+	// the trimmed tails are handed out to later requests
+	blocks[2] = buddy_pool_alloc(pool, 4 * CHECK_PAGE_SIZE);
+	stats = check_stats(pool, CHECK_ARENA, "tail reused");
+	expect(blocks[2] != NULL && blocks[2] < blocks[0] + 32 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_used == 29 * CHECK_PAGE_SIZE);
+
+	// trimmed blocks shrink in place but move to grow
+	fill(blocks[1], 5 * CHECK_PAGE_SIZE - 100, 5);
+	expect(buddy_pool_realloc(pool, blocks[1], 3 * CHECK_PAGE_SIZE) == blocks[1]);
+	check_stats(pool, CHECK_ARENA, "trimmed block shrunk");
+	moved = buddy_pool_realloc(pool, blocks[1], 7 * CHECK_PAGE_SIZE);
+	check_stats(pool, CHECK_ARENA, "trimmed block grown");
+	expect(moved != NULL && holds(moved, 3 * CHECK_PAGE_SIZE, 5));
+	expect(buddy_pool_usable_size(pool, moved) == 7 * CHECK_PAGE_SIZE);
+	blocks[1] = moved;
+
+	for (int i = 0; i < 3; ++i) {
+		buddy_pool_free(pool, blocks[i]);
+		check_stats(pool, CHECK_ARENA, "trimmed blocks being freed");
+	}
+	check_coalesced(pool, CHECK_ARENA, "trimmed blocks freed");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Thread caches of blocks up to 32K
+ */
+static void setup_caches(buddy_pool_config_t* config)
+{
+	config->cache_max_order = 15;
+}
+
+/**
+ * buddy_pool_get_stats counts exactly what was split, merged, granted and
+ * requested, including the shares of the thread caches
+ */
+static void check_stats_accounting(void)
+{
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, NULL);
+	struct buddy_stats stats;
+	void* blocks[10];
+	int splits = 22 - CHECK_MIN_ORDER; // from the whole arena down to a page
+
+	blocks[0] = buddy_pool_alloc(pool, 100);
+	blocks[1] = buddy_pool_alloc(pool, 5000);
+	blocks[2] = buddy_pool_alloc(pool, 3 * CHECK_PAGE_SIZE);
+	stats = check_stats(pool, CHECK_ARENA, "three blocks allocated");
+	expect(stats.splits == (unsigned long) splits);
+	expect(stats.merges == 0);
+	expect(stats.bytes_used == 7 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_allocated == 7 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_requested == 100 + 5000 + 3 * CHECK_PAGE_SIZE);
+	expect(stats.free_blocks[CHECK_MIN_ORDER] == 1);
+
+	buddy_pool_free(pool, blocks[1]);
+	stats = check_stats(pool, CHECK_ARENA, "middle block freed");
+	expect(stats.bytes_allocated == 5 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_requested == 100 + 3 * CHECK_PAGE_SIZE);
+	expect(stats.peak_used == 7 * CHECK_PAGE_SIZE);
+
+	buddy_pool_free(pool, blocks[0]);
+	buddy_pool_free(pool, blocks[2]);
+	stats = check_stats(pool, CHECK_ARENA, "every block freed");
+	expect(stats.merges == stats.splits);
+	check_coalesced(pool, CHECK_ARENA, "every block freed");
+	buddy_pool_destroy(pool);
+
+	// blocks sitting in a thread cache are used but not allocated
+	pool = make_pool(CHECK_ARENA, setup_caches);
+	for (int i = 0; i < 10; ++i)
+		blocks[i] = buddy_pool_alloc(pool, CHECK_PAGE_SIZE - i);
+	for (int i = 0; i < 5; ++i)
+		buddy_pool_free(pool, blocks[i]);
+	stats = check_stats(pool, CHECK_ARENA, "thread cache in use");
+	expect(stats.bytes_allocated == 5 * CHECK_PAGE_SIZE);
+	expect(stats.bytes_requested == 5 * CHECK_PAGE_SIZE - (5 + 6 + 7 + 8 + 9));
+	expect(stats.bytes_used >= 10 * CHECK_PAGE_SIZE);
+	for (int i = 5; i < 10; ++i)
+		buddy_pool_free(pool, blocks[i]);
+	stats = check_stats(pool, CHECK_ARENA, "thread cache holding every block");
+	expect(stats.bytes_allocated == 0 && stats.bytes_requested == 0);
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Slabs for requests of up to 2K
+ */
+static void setup_slab(buddy_pool_config_t* config)
+{
+	config->slab = 1;
+}
+
+/**
+ * A block of check_slab
+ */
+typedef struct slab_block_t {
+	char* addr;
+	size_t size;  ///< Bytes it holds the fill of
+	unsigned seed;
+} slab_block_t;
+
+/**
+ * Slab objects of every class, at full and just over half the class size,
+ * are distinct and keep their contents through resizes within the slabs,
+ * out to whole pages and back. Freed, the slabs go back to the pool.
+ */
+static void check_slab(void)
+{
+	enum { MAX_BLOCKS = CHECK_PAGE_SIZE / 2 + 6 * CHECK_SLAB_CLASSES }; // per class two sizes of two pages of objects and 3 more
+	buddy_pool_t* pool = make_pool(CHECK_ARENA, setup_slab);
+	static slab_block_t blocks[MAX_BLOCKS];
+	struct buddy_stats stats;
+	bool sound = true;
+	int n = 0;
+
+	// enough objects of each size to fill several slabs of its class
+	for (int c = 0; c < CHECK_SLAB_CLASSES; ++c) {
+		size_t object = 16UL << c;
+
+		for (size_t size = object; size > object / 2; size = object / 2 + 1) {
+			int count = 2 * (int) (CHECK_PAGE_SIZE / object) + 3;
+
+			for (int i = 0; i < count; ++i, ++n) {
+				char* addr = buddy_pool_alloc(pool, size);
+
+				blocks[n] = (slab_block_t) { addr, size, (unsigned) n };
+				sound &= addr != NULL && ((uintptr_t) addr & 15) == 0;
+				sound &= addr != NULL && buddy_pool_usable_size(pool, addr) == object;
+				if (addr != NULL)
+					fill(addr, size, n);
+			}
+			if (size == object / 2 + 1)
+				break;
+		}
+	}
+	check_step = "slab objects allocated";
+	expect(sound);
+	for (int i = 0; i < n; ++i)
+		sound &= holds(blocks[i].addr, blocks[i].size, blocks[i].seed);
+	expect(sound); // so none of them overlap
+
+	// grow every third object into the next class or out to a page, shrink
+	// every fifth, and move every seventh out to three pages
+	for (int i = 0; i < n; ++i) {
+		size_t size = i % 3 == 0 ? 2 * blocks[i].size :
+		              i % 5 == 0 ? blocks[i].size / 2 + 1 :
+		              i % 7 == 0 ? 3 * CHECK_PAGE_SIZE : 0;
+		size_t kept = size < blocks[i].size ? size : blocks[i].size;
+		char* addr;
+
+		if (size == 0)
+			continue;
+		addr = buddy_pool_realloc(pool, blocks[i].addr, size);
+		sound &= addr != NULL && holds(addr, kept, blocks[i].seed);
+		sound &= addr != NULL && buddy_pool_usable_size(pool, addr) >= size;
+		if (addr != NULL) {
+			blocks[i] = (slab_block_t) { addr, size, blocks[i].seed + 1 };
+			fill(addr, size, blocks[i].seed);
+		}
+	}
+	check_step = "slab objects resized";
+	expect(sound);
+
+	// pages back down into a slab
+	for (int i = 0; i < n; ++i) {
+		char* addr;
+
+		if (blocks[i].size != 3 * CHECK_PAGE_SIZE)
+			continue;
+		addr = buddy_pool_realloc(pool, blocks[i].addr, 100);
+
+		sound &= addr != NULL && holds(addr, 100, blocks[i].seed);
+		if (addr != NULL)
+			blocks[i] = (slab_block_t) { addr, 100, blocks[i].seed };
+	}
+	for (int i = 0; i < n; ++i)
+		sound &= holds(blocks[i].addr, blocks[i].size, blocks[i].seed);
+	check_step = "blocks shrunk into slabs";
+	expect(sound);
+
+	for (int i = 1; i < n; i += 2)
+		buddy_pool_free(pool, blocks[i].addr);
+	for (int i = 0; i < n; i += 2)
+		buddy_pool_free(pool, blocks[i].addr);
+	stats = check_stats(pool, CHECK_ARENA, "slab objects freed");
+	expect(stats.bytes_allocated == 0 && stats.bytes_requested == 0);
+	check_coalesced(pool, CHECK_ARENA, "slab objects freed");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Blocks in flight between the threads of check_threads. Every block starts
+ * with its size and a seed, then CHECK_FILL bytes filled from the seed, and
+ * ends in the low byte of the seed.
+ */
+static void* swap_slots[CHECK_SLOTS];
+
+/**
+ * Arguments of a swap_thread
+ */
+typedef struct swapper_t {
+	buddy_pool_t* pool;  ///< Pool the blocks come from
+	unsigned seed;       ///< Seed of the thread's sizes and fills
+	int bad;             ///< Blocks picked up with the wrong contents
+} swapper_t;
+
+/**
+ * Allocate blocks, swap each into a random slot, and check and free the
+ * block found there, which another thread most likely allocated
+ */
+static void* swap_thread(void* arg)
+{
+	swapper_t* swapper = arg;
+
+	for (int i = 0; i < CHECK_SWAPS; ++i) {
+		unsigned seed = swapper->seed = swapper->seed * 1103515245 + 12345;
+		size_t size = 2 * sizeof(size_t) + CHECK_FILL + 1 + (seed >> 8) % (8 * CHECK_PAGE_SIZE);
+		size_t* block = buddy_pool_alloc(swapper->pool, size);
+		size_t* old;
+
+		if (block == NULL) {
+			swapper->bad++;
+			continue;
+		}
+		block[0] = size;
+		block[1] = seed;
+		fill(block + 2, CHECK_FILL, seed);
+		((unsigned char*) block)[size - 1] = (unsigned char) seed;
+
+		old = __atomic_exchange_n(&swap_slots[seed % CHECK_SLOTS], block, __ATOMIC_ACQ_REL);
+		if (old != NULL) {
+			swapper->bad += !holds(old + 2, CHECK_FILL, old[1]) ||
+			                ((unsigned char*) old)[old[0] - 1] != (unsigned char) old[1];
+			buddy_pool_free(swapper->pool, old);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Free the blocks left in the slots
+ */
+static void* sweep_thread(void* arg)
+{
+	for (int i = 0; i < CHECK_SLOTS; ++i) {
+		buddy_pool_free(arg, swap_slots[i]);
+		swap_slots[i] = NULL;
+	}
+
+	return NULL;
+}
+
+/**
+ * Run a function on a thread of its own and wait for it, so that its thread
+ * cache is flushed back to the pool when it returns
+ */
+static void run_thread(void* (*run)(void*), void* arg)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, run, arg) != 0) {
+		fprintf(stderr, "ERROR: Failed to create a thread\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_join(thread, NULL);
+}
+
+/**
+ * Threads with caches of blocks up to 32K swap blocks, so most of them are
+ * freed by another thread than the one that allocated them. Their contents
+ * survive, and once the threads exit their caches flush and the pool
+ * coalesces.
+ */
+static void check_threads(void)
+{
+	buddy_pool_t* pool = make_pool(CHECK_THREAD_ARENA, setup_caches);
+	pthread_t threads[CHECK_THREADS];
+	swapper_t swappers[CHECK_THREADS];
+	struct buddy_stats stats;
+	int bad = 0;
+
+	for (int t = 0; t < CHECK_THREADS; ++t) {
+		swappers[t] = (swapper_t) { pool, 2 * t + 1, 0 };
+		if (pthread_create(&threads[t], NULL, swap_thread, &swappers[t]) != 0) {
+			fprintf(stderr, "ERROR: Failed to create a thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int t = 0; t < CHECK_THREADS; ++t) {
+		pthread_join(threads[t], NULL);
+		bad += swappers[t].bad;
+	}
+
+	check_step = "threads swapped blocks";
+	expect(bad == 0);
+	stats = check_stats(pool, CHECK_THREAD_ARENA, "threads swapped blocks");
+	expect(stats.bytes_allocated > 0);
+
+	run_thread(sweep_thread, pool);
+	stats = check_stats(pool, CHECK_THREAD_ARENA, "blocks in flight freed");
+	expect(stats.bytes_allocated == 0 && stats.bytes_requested == 0);
+	check_coalesced(pool, CHECK_THREAD_ARENA, "threads exited");
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Thread caches of single pages, large enough for a whole small pool
+ */
+static void setup_page_cache(buddy_pool_config_t* config)
+{
+	config->cache_max_order = CHECK_MIN_ORDER;
+	config->cache_size = 64;
+}
+
+/**
+ * A pool whose every free page sits in the caller's thread cache still
+ * serves requests the cache cannot, by draining the cache first
+ */
+static void check_cache_drain(void)
+{
+	enum { PAGES = 16 };
+	buddy_pool_t* pool = make_pool(PAGES * CHECK_PAGE_SIZE, setup_page_cache);
+	struct buddy_stats stats;
+	void* pages[PAGES];
+	void* block;
+
+	for (int i = 0; i < PAGES; ++i)
+		pages[i] = buddy_pool_alloc(pool, CHECK_PAGE_SIZE);
+	check_step = "every page allocated";
+	expect(buddy_pool_alloc(pool, 1) == NULL);
+	for (int i = 0; i < PAGES; ++i)
+		buddy_pool_free(pool, pages[i]);
+	stats = check_stats(pool, PAGES * CHECK_PAGE_SIZE, "every page cached");
+	expect(stats.bytes_free == 0 && stats.bytes_allocated == 0);
+
+	// two pages and then the whole pool come out of the drained cache
+	block = buddy_pool_alloc(pool, 2 * CHECK_PAGE_SIZE);
+	check_stats(pool, PAGES * CHECK_PAGE_SIZE, "two pages allocated");
+	expect(block != NULL);
+	buddy_pool_free(pool, block);
+	block = buddy_pool_alloc(pool, PAGES * CHECK_PAGE_SIZE);
+	check_stats(pool, PAGES * CHECK_PAGE_SIZE, "whole pool allocated");
+	expect(block != NULL);
+	buddy_pool_free(pool, block);
+	check_coalesced(pool, PAGES * CHECK_PAGE_SIZE, "whole pool freed");
+
+	// a page still comes out of the cache when the free lists are empty
+	for (int i = 0; i < PAGES; ++i)
+		pages[i] = buddy_pool_alloc(pool, CHECK_PAGE_SIZE);
+	buddy_pool_free(pool, pages[0]);
+	check_step = "one page cached";
+	expect((pages[0] = buddy_pool_alloc(pool, CHECK_PAGE_SIZE)) != NULL);
+	for (int i = 0; i < PAGES; ++i)
+		buddy_pool_free(pool, pages[i]);
+	buddy_pool_destroy(pool);
+}
+
+/**
+ * Create a shared or file pool for a check, with the default configuration
+ */
+static buddy_pool_t* make_persistent_pool(const char* name, bool file)
+{
+	buddy_pool_config_t config;
+	buddy_pool_t* pool;
+
+	buddy_pool_config_init(&config, CHECK_ARENA, CHECK_MIN_ORDER);
+	pool = file ? buddy_pool_create_file(name, &config) : buddy_pool_create_shared(name, &config);
+	if (pool == NULL) {
+		fprintf(stderr, "ERROR: Failed to create %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	return pool;
+}
+
+/**
+ * Read exactly size bytes from a pipe
+ */
+static bool read_all(int fd, void* buf, size_t size)
+{
+	for (size_t done = 0; done < size;) {
+		ssize_t got = read(fd, (char*) buf + done, size - done);
+
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+
+	return true;
+}
+
+/**
+ * Wait for a child process
+ *
+ * @return Whether it exited with EXIT_SUCCESS, or died of sig if sig is not 0
+ */
+static bool reap(pid_t pid, int sig)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid)
+		return false;
+
+	return sig != 0 ? WIFSIGNALED(status) && WTERMSIG(status) == sig
+	                : WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/**
+ * Child side of check_shared: maps the pool by name, checks the block the
+ * parent handed over, then allocates CHECK_BLOCKS blocks of its own and
+ * sends their offsets back. With hold set it then takes the pool lock and
+ * waits to be killed, otherwise it exits.
+ */
+static void shared_child(const char* name, int in, int out, bool hold)
+{
+	buddy_pool_t* pool = buddy_pool_open_shared(name);
+	size_t offsets[CHECK_BLOCKS];
+	size_t given;
+	char ready = 1;
+
+	if (pool == NULL || !read_all(in, &given, sizeof(given)) ||
+	    !holds(buddy_pool_address(pool, given), CHECK_PAGE_SIZE, 6))
+		_exit(EXIT_FAILURE);
+
+	for (int i = 0; i < CHECK_BLOCKS; ++i) {
+		char* block = buddy_pool_alloc(pool, (i + 1) * CHECK_PAGE_SIZE);
+
+		if (block == NULL)
+			_exit(EXIT_FAILURE);
+		fill(block, (i + 1) * CHECK_PAGE_SIZE, 7 + i);
+		offsets[i] = buddy_pool_offset(pool, block);
+	}
+	if (write(out, offsets, sizeof(offsets)) != sizeof(offsets))
+		_exit(EXIT_FAILURE);
+
+	if (hold) {
+		buddy_pool_lock(pool);
+		if (write(out, &ready, 1) != 1)
+			_exit(EXIT_FAILURE);
+		for (;;)
+			pause();
+	}
+
+	buddy_pool_destroy(pool);
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Child of check_shared that allocates and frees blocks of random sizes in a
+ * shared pool until it is killed
+ */
+static void churn_child(const char* name, unsigned seed)
+{
+	buddy_pool_t* pool = buddy_pool_open_shared(name);
+	void* window[4] = { NULL };
+
+	if (pool == NULL)
+		_exit(EXIT_FAILURE);
+
+	for (unsigned i = 0;; ++i) {
+		void** slot = &window[i % 4];
+
+		seed = seed * 1103515245 + 12345;
+		buddy_pool_free(pool, *slot);
+		*slot = buddy_pool_alloc(pool, 1 + (seed >> 8) % (4 * CHECK_PAGE_SIZE));
+	}
+}
+
+/**
+ * Fork a shared_child, hand it a block and collect the offsets of its
+ * blocks. A child told to hold the lock is killed once it has it.
+ *
+ * @return Whether the child did its part
+ */
+static bool run_shared_child(buddy_pool_t* pool, const char* name, void* given, bool hold, size_t offsets[CHECK_BLOCKS])
+{
+	size_t offset = buddy_pool_offset(pool, given);
+	int down[2], up[2];
+	bool done;
+	char ready;
+	pid_t pid;
+
+	if (pipe(down) != 0 || pipe(up) != 0) {
+		perror("ERROR: pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		close(down[1]);
+		close(up[0]);
+		shared_child(name, down[0], up[1], hold);
+	}
+	close(down[0]);
+	close(up[1]);
+
+	done = pid > 0 && write(down[1], &offset, sizeof(offset)) == sizeof(offset) &&
+	       read_all(up[0], offsets, CHECK_BLOCKS * sizeof(size_t));
+	if (hold) {
+		done &= read_all(up[0], &ready, 1);
+		kill(pid, SIGKILL);
+	}
+	done &= reap(pid, hold ? SIGKILL : 0);
+
+	close(down[1]);
+	close(up[0]);
+	return done;
+}
+
+/**
+ * A shared pool is used by several processes at different addresses, blocks
+ * are handed over as offsets, and a process killed while holding the pool
+ * lock leaves a pool that is rebuilt by the next one to lock it
+ */
+static void check_shared(void)
+{
+	char name[64];
+	buddy_pool_t* pool;
+	buddy_pool_t* again;
+	struct buddy_stats stats;
+	size_t offsets[CHECK_BLOCKS];
+	size_t used = 0;
+	char* given;
+
+	snprintf(name, sizeof(name), "/buddy-check-%d", (int) getpid());
+	buddy_pool_unlink_shared(name);
+	pool = make_persistent_pool(name, false);
+	given = buddy_pool_alloc(pool, CHECK_PAGE_SIZE);
+	fill(given, CHECK_PAGE_SIZE, 6);
+
+	for (int i = 0; i < CHECK_BLOCKS; ++i)
+		used += (1UL << (64 - __builtin_clzl((i + 1) * CHECK_PAGE_SIZE - 1)));
+
+	// blocks allocated by a child read the same through the parent's mapping
+	check_step = "child handing over blocks";
+	expect(run_shared_child(pool, name, given, false, offsets));
+	for (int i = 0; i < CHECK_BLOCKS; ++i)
+		expect(holds(buddy_pool_address(pool, offsets[i]), (i + 1) * CHECK_PAGE_SIZE, 7 + i));
+	stats = check_stats(pool, CHECK_ARENA, "child blocks handed over");
+	expect(stats.bytes_used == CHECK_PAGE_SIZE + used);
+	for (int i = 0; i < CHECK_BLOCKS; ++i)
+		buddy_pool_free(pool, buddy_pool_address(pool, offsets[i]));
+	check_stats(pool, CHECK_ARENA, "child blocks freed");
+
+	// the next lock after the holder died rebuilds the pool as it was
+	check_step = "child killed holding the lock";
+	expect(run_shared_child(pool, name, given, true, offsets));
+	stats = check_stats(pool, CHECK_ARENA, "pool recovered");
+	expect(stats.bytes_used == CHECK_PAGE_SIZE + used);
+	expect(holds(given, CHECK_PAGE_SIZE, 6));
+	for (int i = 0; i < CHECK_BLOCKS; ++i) {
+		expect(holds(buddy_pool_address(pool, offsets[i]), (i + 1) * CHECK_PAGE_SIZE, 7 + i));
+		buddy_pool_free(pool, buddy_pool_address(pool, offsets[i]));
+	}
+
+	// a second mapping in the same process sees the same pool
+	again = buddy_pool_open_shared(name);
+	check_step = "pool opened again";
+	expect(again != NULL && again != pool);
+	if (again != NULL) {
+		expect(holds(buddy_pool_address(again, buddy_pool_offset(pool, given)), CHECK_PAGE_SIZE, 6));
+		buddy_pool_free(again, buddy_pool_address(again, buddy_pool_offset(pool, given)));
+		check_coalesced(again, CHECK_ARENA, "every block freed through the second mapping");
+		buddy_pool_destroy(again);
+	}
+	check_coalesced(pool, CHECK_ARENA, "every block freed");
+
+	// children killed at random points of their churn, often inside the lock
+	for (int round = 0; round < 20; ++round) {
+		pid_t pid;
+
+		fflush(stdout);
+		if ((pid = fork()) == 0)
+			churn_child(name, round);
+		usleep(1000 + round * 250);
+		kill(pid, SIGKILL);
+		check_step = "churning child killed";
+		expect(reap(pid, SIGKILL));
+		check_stats(pool, CHECK_ARENA, "churning child killed");
+	}
+	expect(buddy_pool_alloc(pool, CHECK_PAGE_SIZE) != NULL);
+
+	buddy_pool_destroy(pool);
+	expect(buddy_pool_unlink_shared(name) == 0);
+	expect(buddy_pool_open_shared(name) == NULL);
+}
+
+/**
+ * Allocate the blocks of check_file and record their offsets in the root
+ * block, whose first slot counts them
+ */
+static void file_blocks(buddy_pool_t* pool, int first, int n)
+{
+	size_t* root = buddy_pool_root(pool);
+
+	for (int i = first; i < first + n; ++i) {
+		char* block = buddy_pool_alloc(pool, (i % 4 + 1) * CHECK_PAGE_SIZE);
+
+		fill(block, (i % 4 + 1) * CHECK_PAGE_SIZE, 20 + i);
+		root[i + 1] = buddy_pool_offset(pool, block);
+		root[0] = i + 1;
+	}
+}
+
+/**
+ * A file pool survives being closed, and a process dying with it open leaves
+ * a pool whose free lists and accounting are rebuilt on the next open
+ */
+static void check_file(void)
+{
+	char path[64];
+	buddy_pool_t* pool;
+	struct buddy_stats stats;
+	size_t* root;
+	size_t used;
+	int recovered = -1;
+	pid_t pid;
+
+	snprintf(path, sizeof(path), "/tmp/buddy-check-%d.pool", (int) getpid());
+	unlink(path);
+	pool = make_persistent_pool(path, true);
+	buddy_pool_set_root(pool, buddy_pool_alloc(pool, CHECK_PAGE_SIZE));
+	file_blocks(pool, 0, CHECK_BLOCKS);
+	used = check_stats(pool, CHECK_ARENA, "file pool filled").bytes_used;
+	buddy_pool_destroy(pool);
+
+	// a clean reopen finds everything where it was
+	pool = buddy_pool_open_file(path, &recovered);
+	check_step = "file pool reopened";
+	expect(pool != NULL);
+	if (pool == NULL)
+		return;
+	expect(recovered == 0);
+	expect(buddy_pool_open_file(path, NULL) == NULL); // locked while open
+	stats = check_stats(pool, CHECK_ARENA, "file pool reopened");
+	expect(stats.bytes_used == used);
+	root = buddy_pool_root(pool);
+	expect(root != NULL && root[0] == CHECK_BLOCKS);
+	buddy_pool_destroy(pool);
+
+	// a child that dies with the pool open, the lock goes with it
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		if ((pool = buddy_pool_open_file(path, NULL)) == NULL)
+			_exit(EXIT_FAILURE);
+		file_blocks(pool, CHECK_BLOCKS, CHECK_BLOCKS);
+		raise(SIGKILL);
+	}
+	check_step = "child killed with the file open";
+	expect(pid > 0 && reap(pid, SIGKILL));
+
+	pool = buddy_pool_open_file(path, &recovered);
+	check_step = "file pool recovered";
+	expect(pool != NULL);
+	if (pool == NULL)
+		return;
+	expect(recovered == 1);
+	stats = check_stats(pool, CHECK_ARENA, "file pool recovered");
+	root = buddy_pool_root(pool);
+	expect(root[0] == 2 * CHECK_BLOCKS);
+	expect(stats.bytes_used > used);
+	for (size_t i = 0; i < root[0]; ++i) {
+		expect(holds(buddy_pool_address(pool, root[i + 1]), (i % 4 + 1) * CHECK_PAGE_SIZE, 20 + i));
+		buddy_pool_free(pool, buddy_pool_address(pool, root[i + 1]));
+	}
+	buddy_pool_set_root(pool, NULL);
+	buddy_pool_free(pool, root);
+	check_coalesced(pool, CHECK_ARENA, "recovered blocks freed");
+	buddy_pool_destroy(pool);
+
+	// closed cleanly again, then cut short
+	pool = buddy_pool_open_file(path, &recovered);
+	check_step = "file pool closed after recovery";
+	expect(pool != NULL && recovered == 0);
+	buddy_pool_destroy(pool);
+	expect(truncate(path, CHECK_ARENA / 2) == 0);
+	check_step = "file cut short";
+	expect(buddy_pool_open_file(path, NULL) == NULL);
+	unlink(path);
+}
+
+
+static const check_t checks[] = {
+	{ "realloc", "buddy_pool_realloc grows, moves and shrinks keeping the contents", check_realloc },
+	{ "bulk", "bulk alloc hands out distinct blocks, bulk free coalesces them", check_bulk },
+	{ "lazy", "lazy coalescing drains to its watermarks and merges on demand", check_lazy },
+	{ "exact-fit", "exact fit trims blocks to the pages used and frees them whole", check_exact_fit },
+	{ "stats", "statistics count splits, merges and bytes exactly", check_stats_accounting },
+	{ "slab", "slab objects of every class keep their contents through resizes", check_slab },
+	{ "threads", "threads with caches swap blocks and free each other's", check_threads },
+	{ "cache-drain", "a pool held entirely in a thread cache still serves larger requests", check_cache_drain },
+	{ "shared", "shared pools hand blocks between processes and outlive a dead lock holder", check_shared },
+	{ "file", "file pools reopen as they were closed and recover from a dead process", check_file },
+};
+
+#define NUM_CHECKS (int)(sizeof(checks) / sizeof(checks[0]))
+
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  %s [-l] [check...]\n", prog_name);
+	fprintf(out, "     -l - List the available checks. With no check\n");
+	fprintf(out, "          arguments every check is run.\n");
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	if (argc == 2 && strcmp(argv[1], "-l") == 0) {
+		for (int i = 0; i < NUM_CHECKS; ++i)
+			printf("%-16s %s\n", checks[i].name, checks[i].description);
+		return EXIT_SUCCESS;
+	}
+
+	for (int j = 1; j < argc; ++j) {
+		bool found = false;
+
+		for (int i = 0; i < NUM_CHECKS; ++i)
+			if (strcmp(argv[j], checks[i].name) == 0)
+				found = true;
+
+		if (!found) {
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int i = 0; i < NUM_CHECKS; ++i) {
+		bool selected = argc == 1;
+
+		for (int j = 1; j < argc; ++j)
+			if (strcmp(argv[j], checks[i].name) == 0)
+				selected = true;
+
+		if (!selected)
+			continue;
+
+		failures = 0;
+		checks[i].run();
+		printf("%-16s %s\n", checks[i].name, failures == 0 ? "passed" : "FAILED");
+		failed += failures != 0;
+	}
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buddy.h"
+
+/*
+ * The malloc family on top of a buddy pool, built as libbuddy.so so that
+ * any program can run on the allocator:
+ *
+ *     LD_PRELOAD=./libbuddy.so program
+ *
+ * Every request is served from one pool with 4K pages, slabs for requests of
+ * up to 2K and per-thread caches for blocks of up to 32K. The arena is only
+ * reserved, BUDDY_ARENA_SIZE bytes of it (64 GiB by default), and free
+ * blocks of 1 MiB or more are given back to the OS. Requests the pool cannot
+ * serve fall back to a mapping of their own, and so do the few allocations
+ * buddy.c makes for itself (the pool and its thread caches), since they are
+ * made while the pool is busy. The pool lock is held across fork() so the
+ * child never inherits it locked by a thread that does not exist there.
+ */
+
+#define PAGE_ORDER 12              // order of the pool's pages
+#define CACHE_ORDER 15             // largest order kept in thread caches
+#define RELEASE_ORDER 20           // free blocks this large are released
+#define DEFAULT_ARENA (1UL << 36)  // bytes reserved when BUDDY_ARENA_SIZE is unset
+#define MIN_ALIGN 16               // alignment malloc guarantees
+
+/**
+ * Header in front of a request served by a mapping of its own
+ */
+typedef struct chunk_t {
+	void* base;    ///< Start of the mapping
+	size_t length; ///< Bytes mapped
+} chunk_t;
+
+
+static buddy_pool_t* pool;                  // NULL until created, or if that failed
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread int depth __attribute__((tls_model("initial-exec"))); // calls into the pool in progress
+
+
+/**
+ * Hold the pool still for fork(), allocations the fork makes meanwhile get
+ * mappings of their own
+ */
+static void lock_pool(void)
+{
+	++depth;
+	buddy_pool_lock(pool);
+}
+
+/**
+ * Release the pool after fork(), in the parent and in the child
+ */
+static void unlock_pool(void)
+{
+	buddy_pool_unlock(pool);
+	--depth;
+}
+
+/**
+ * Create the pool on first use
+ */
+static void create_pool(void)
+{
+	buddy_pool_config_t config;
+	const char* size = getenv("BUDDY_ARENA_SIZE");
+
+	buddy_pool_config_init(&config, size != NULL ? strtoul(size, NULL, 0) : DEFAULT_ARENA, PAGE_ORDER);
+	config.slab = 1;
+	config.cache_max_order = CACHE_ORDER;
+	config.release_order = RELEASE_ORDER;
+
+	if ((pool = buddy_pool_create_config(&config)) != NULL)
+		pthread_atfork(lock_pool, unlock_pool, unlock_pool);
+}
+
+/**
+ * Serve a request from a mapping of its own
+ *
+ * @param size Bytes wanted
+ * @param align Alignment wanted, a power of two
+ * @return The memory, NULL if it cannot be mapped
+ */
+static void* map_chunk(size_t size, size_t align)
+{
+	size_t page = 1UL << PAGE_ORDER;
+	size_t offset = align > sizeof(chunk_t) ? align : sizeof(chunk_t);
+	size_t length;
+	char* base;
+	char* addr;
+
+	// room for the header, and for sliding to the alignment past a page
+	if (size > SIZE_MAX - offset - 2 * align - page)
+		return NULL;
+	length = (offset + size + (align > page ? align : 0) + page - 1) & ~(page - 1);
+
+	base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	addr = (char*) (((uintptr_t) base + offset + align - 1) & ~(uintptr_t) (align - 1));
+	((chunk_t*) addr)[-1] = (chunk_t) { base, length };
+
+	return addr;
+}
+
+/**
+ * Bytes usable in a request served by a mapping of its own
+ */
+static size_t chunk_size(void* addr)
+{
+	const chunk_t* chunk = (const chunk_t*) addr - 1;
+
+	return (char*) chunk->base + chunk->length - (char*) addr;
+}
+
+/**
+ * Bytes usable in a block of the pool
+ *
+ * @return 0 if the address does not come from the pool
+ */
+static size_t pool_size(void* addr)
+{
+	return pool != NULL ? buddy_pool_usable_size(pool, addr) : 0;
+}
+
+/**
+ * Allocate from the pool, or from a mapping of its own if the pool cannot
+ * serve the request or is the caller
+ *
+ * @param size Bytes wanted
+ * @param align Alignment wanted, a power of two
+ * @return The memory, NULL with errno set to ENOMEM on failure
+ */
+static void* allocate(size_t size, size_t align)
+{
+	void* addr = NULL;
+
+	if (depth++ == 0) {
+		pthread_once(&pool_once, create_pool);
+
+		if (pool != NULL)
+			addr = buddy_pool_alloc_aligned(pool, size, align);
+	}
+	--depth;
+
+	if (addr == NULL && (addr = map_chunk(size, align)) == NULL)
+		errno = ENOMEM;
+
+	return addr;
+}
+
+void* malloc(size_t size)
+{
+	return allocate(size, MIN_ALIGN);
+}
+
+void free(void* addr)
+{
+	if (addr == NULL)
+		return;
+
+	if (pool_size(addr) != 0) {
+		++depth;
+		buddy_pool_free(pool, addr);
+		--depth;
+	} else {
+		const chunk_t* chunk = (const chunk_t*) addr - 1;
+
+		munmap(chunk->base, chunk->length);
+	}
+}
+
+void* calloc(size_t count, size_t size)
+{
+	void* addr;
+
+	if (size != 0 && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// fresh mappings are already zeroed
+	if ((addr = allocate(count * size, MIN_ALIGN)) != NULL && pool_size(addr) != 0)
+		memset(addr, 0, count * size);
+
+	return addr;
+}
+
+void* realloc(void* addr, size_t size)
+{
+	size_t old;
+	void* moved;
+
+	if (addr == NULL)
+		return malloc(size);
+
+	if (size == 0) {
+		free(addr);
+		return NULL;
+	}
+
+	if ((old = pool_size(addr)) != 0) {
+		++depth;
+		moved = buddy_pool_realloc(pool, addr, size);
+		--depth;
+
+		if (moved != NULL)
+			return moved;
+	} else if ((old = chunk_size(addr)) >= size && size >= old / 2) {
+		return addr;
+	}
+
+	if ((moved = malloc(size)) == NULL)
+		return NULL;
+
+	memcpy(moved, addr, old < size ? old : size);
+	free(addr);
+
+	return moved;
+}
+
+void* reallocarray(void* addr, size_t count, size_t size)
+{
+	if (size != 0 && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(addr, count * size);
+}
+
+void* memalign(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return allocate(size, align > MIN_ALIGN ? align : MIN_ALIGN);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void** out, size_t align, size_t size)
+{
+	void* addr;
+
+	if (align == 0 || align % sizeof(void*) != 0 || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	if ((addr = memalign(align, size)) == NULL)
+		return ENOMEM;
+
+	*out = addr;
+	return 0;
+}
+
+void* valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* addr)
+{
+	size_t size;
+
+	if (addr == NULL)
+		return 0;
+
+	return (size = pool_size(addr)) != 0 ? size : chunk_size(addr);
+}
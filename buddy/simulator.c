@@ -1,13 +1,15 @@
-#include <assert.h>
-#include <errno.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buddy.h"
+#include "tracefile.h"
 
 /**
  * Various program statuses indicating success or failure of an operation
@@ -27,6 +29,14 @@ typedef enum severity_t {
 	WARNING
 } severity_t;
 
+/**
+ * How the state of the free lists is reported as commands run
+ */
+typedef enum output_t {
+	OUTPUT_TEXT,  ///< buddy_dump every dump_every commands, and at the end
+	OUTPUT_BINARY ///< A binary record after every command, see write_record
+} output_t;
+
 /**
  * Tracks a variable's pointer in memory and whether it is allocated
  * or not
@@ -36,23 +46,263 @@ typedef struct var_t {
 	bool in_use; ///< Is this variable currently in use? This is probably redundant if we assume variables not in use are NULL. For now just leave it as it is
 } var_t;
 
+/**
+ * A numeric handle's slot in the handle table
+ */
+typedef struct handle_t {
+	var_t var;        ///< The handle's variable, first so var_handle can find the rest
+	unsigned long id; ///< Number of the handle
+	bool used;        ///< Whether the slot holds a handle
+} handle_t;
+
+/**
+ * A parsed command, ready to run
+ */
+typedef struct command_t {
+	int op;      ///< TRACE_OP_ALLOC or TRACE_OP_FREE, 0 for a blank line
+	var_t* var;  ///< Variable allocated or freed
+	long size;   ///< Bytes to allocate
+} command_t;
+
+#define MAX_HANDLES (1UL << 32) // Numeric handles go from h0 to h4294967295
+#define HANDLE_SLOTS 1024        // Initial size of the handle table, a power of two
+#define READ_CHUNK (1 << 20)     // Bytes read at a time from input that cannot be mapped
+#define WRITE_BUFFER (1 << 20)   // Bytes of binary records written at a time
+#define RECORD_MAX (10 * (BUDDY_MAX_ORDERS + 1)) // Longest binary record, all varints
+
+
+/**
+ * Position in the line being parsed
+ */
+typedef struct cursor_t {
+	const char* pos; ///< Next byte to read
+	const char* end; ///< End of the line, before its newline
+} cursor_t;
+
 
 static FILE *in = NULL;    // Input file
 static var_t var_map[256]; // Keep track of variable allocations
+static handle_t* handles;   // Numeric handles, open addressed by their number
+static size_t handle_slots; // Slots in handles, a power of two
+static size_t num_handles;  // Handles in the table
 static int linenum = 0;    // Line number in input file
+static cursor_t line;      // Line being parsed
+static char* command;      // Line being parsed without whitespace, built for fault messages
+
+static output_t output = OUTPUT_TEXT;  // What is printed as commands run
+static unsigned long dump_every = 1;   // Commands between text dumps, 0 for only at the end
+static unsigned long commands;         // Commands run successfully
+static unsigned char* records;         // Binary records waiting to be written
+static size_t records_len;             // Bytes in records
+static FILE* records_out;              // Where the binary records go
+static FILE* convert_out;              // Binary trace written instead of running commands
+static bool replay;                    // Input is a binary trace
+
+
+/**
+ * Skip whitespace. Whitespace may appear anywhere in a command, even within
+ * names and numbers, and a NUL byte ends the line early.
+ *
+ * @param cur Cursor to advance
+ * @return Next byte of the line, or -1 at its end
+ */
+static int peek(cursor_t* cur)
+{
+	for (; cur->pos < cur->end; ++cur->pos) {
+		switch (*cur->pos) {
+		case ' ':
+		case '\r':
+		case '\t':
+			break;
+
+		case '\0':
+			cur->end = cur->pos;
+			return -1;
+
+		default:
+			return (unsigned char) *cur->pos;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Consume a literal
+ *
+ * @param cur Cursor to advance
+ * @param word Characters expected next, whitespace aside
+ * @return True if they were all there. The cursor is left where they stopped
+ * matching otherwise.
+ */
+static bool accept(cursor_t* cur, const char* word)
+{
+	for (; *word != '\0'; ++word, ++cur->pos)
+		if (peek(cur) != *word)
+			return false;
+
+	return true;
+}
 
+/**
+ * Check if a literal appears anywhere in the rest of a line
+ *
+ * @param cur Cursor to search from, not advanced
+ * @param word Characters to look for, whitespace aside
+ * @return True if they are found
+ */
+static bool contains(const cursor_t* cur, const char* word)
+{
+	cursor_t from = *cur;
+
+	while (peek(&from) != -1) {
+		cursor_t match = from;
+
+		if (accept(&match, word))
+			return true;
+		++from.pos;
+	}
+
+	return false;
+}
+
+/**
+ * Read a decimal number
+ *
+ * @param cur Cursor to advance
+ * @param sign Whether a leading '+' or '-' is allowed
+ * @param limit Largest magnitude accepted
+ * @param value Receives the number
+ * @return True if there were digits and their value is within the limit
+ */
+static bool read_number(cursor_t* cur, bool sign, unsigned long limit, long* value)
+{
+	bool negative = false;
+	unsigned long number = 0;
+	int c = peek(cur);
+
+	if (sign && (c == '-' || c == '+')) {
+		negative = c == '-';
+		++cur->pos;
+		c = peek(cur);
+	}
+
+	if (!isdigit(c))
+		return false;
+
+	for (; isdigit(c); ++cur->pos, c = peek(cur)) {
+		if (number > (limit - (c - '0')) / 10)
+			return false;
+		number = number * 10 + (c - '0');
+	}
+
+	*value = negative ? -(long) number : (long) number;
+	return true;
+}
+
+/**
+ * Build the line being parsed without its whitespace, the way it is shown
+ * in fault messages
+ *
+ * @return The command text
+ */
+static const char* command_text()
+{
+	cursor_t cur = { line.pos, line.end };
+	char* out;
+
+	free(command);
+	if ((command = out = malloc(line.end - line.pos + 1)) == NULL)
+		return "";
+
+	for (int c; (c = peek(&cur)) != -1; ++cur.pos)
+		*out++ = c;
+	*out = '\0';
+
+	return command;
+}
+
+/**
+ * Find the slot of a numeric handle in a table, or the empty slot it goes in
+ *
+ * @param table Handle table with at least one empty slot
+ * @param slots Slots in the table, a power of two
+ * @param id Number of the handle
+ * @return The slot
+ */
+static handle_t* find_handle(handle_t* table, size_t slots, unsigned long id)
+{
+	size_t i = (id * 0x9E3779B97F4A7C15UL) >> 32;
+
+	for (;; ++i) {
+		handle_t* slot = &table[i & (slots - 1)];
+
+		if (!slot->used || slot->id == id)
+			return slot;
+	}
+}
 
 /**
- * Resolve a variable by name
+ * Resolve a numeric handle, adding it to the handle table the first time it
+ * is named. The table is a hash table kept at most half full, so it only
+ * grows with the number of distinct handles, whatever their numbers. Adding
+ * a handle may move the others.
  *
- * @param var Name of variable
+ * @param id Number of the handle
+ * @return Returns a pointer to location of the handle's representation.
+ * Returns NULL if there is no memory for it.
+ */
+static var_t* get_handle(unsigned long id)
+{
+	handle_t* slot;
+
+	if (2 * (num_handles + 1) > handle_slots) {
+		size_t slots = handle_slots ? 2 * handle_slots : HANDLE_SLOTS;
+		handle_t* grown = calloc(slots, sizeof(handle_t));
+
+		if (grown == NULL)
+			return NULL;
+
+		for (size_t i = 0; i < handle_slots; ++i)
+			if (handles[i].used)
+				*find_handle(grown, slots, handles[i].id) = handles[i];
+		free(handles);
+		handles = grown;
+		handle_slots = slots;
+	}
+
+	slot = find_handle(handles, handle_slots, id);
+	if (!slot->used) {
+		*slot = (handle_t) { .id = id, .used = true };
+		++num_handles;
+	}
+
+	return &slot->var;
+}
+
+/**
+ * Resolve a variable by name. A name is either a single letter or a numeric
+ * handle: 'h' directly followed by a decimal number, e.g. h123456.
+ *
+ * @param cur Cursor at the name, advanced past it
  * @return Returns a pointer to location of the variable's
- * representation. Returns NULL if the var is not an alphabetic character.
+ * representation. Returns NULL if the name is neither an alphabetic
+ * character nor a valid handle.
  */
-static var_t* get_var(char var)
+static var_t* get_var(cursor_t* cur)
 {
+	int var = peek(cur);
+	long id;
+
+	if (var == -1)
+		return NULL;
+	++cur->pos;
+
+	if (var == 'h' && isdigit(peek(cur)))
+		return read_number(cur, false, MAX_HANDLES - 1, &id) ? get_handle(id) : NULL;
+
 	if ((var >= 'a' && var <= 'z') || (var >= 'A' && var <= 'Z'))
-		return &var_map[(int) var];
+		return &var_map[var];
 	else
 		return NULL;
 }
@@ -96,57 +346,75 @@ static status_t parse_error(const char* cmd)
 }
 
 /**
- * Parses an allocation instruction
+ * Number a variable the way binary traces do, see tracefile.h
  *
- * @param cmd String representing an allocation command in the program
- * @returns Status of read and execute
- */
-static status_t parse_alloc(char* cmd)
-{
-	assert(cmd != NULL);
-	assert(cmd[0] != '\0');
-
-	char var_name;
-	int size;
-	char alter_size;
-	int matched;
-
-	errno = 0;
-	matched = sscanf(cmd, "%c=alloc(%d%c)", &var_name, &size, &alter_size);
-
-	// Error check sprintf
-	if (matched == 3 && errno == 0) {
-		// Check what the alter_size variable actually contains
-		switch (alter_size) {
-		case 'k':
-		case 'K':
-			size *= 1024;
-		case ')':
-			break;
-		default:
-			return parse_error(cmd);
-		}
-	}
-	else {
-		return parse_error(cmd);
-	}
+ * @param var Letter variable or numeric handle
+ * @return The trace handle
+ */
+static uint64_t var_handle(const var_t* var)
+{
+	if (var >= var_map && var < var_map + 256)
+		return var - var_map;
+	else
+		return TRACE_LETTERS + ((const handle_t*) var)->id;
+}
 
-	// Resolve variable
-	var_t* var = get_var(var_name);
+/**
+ * Describe a command for fault messages. Commands read from text are shown
+ * as written, commands replayed from a binary trace are spelled out.
+ *
+ * @param cmd Command to describe
+ * @return The command text
+ */
+static const char* describe_command(const command_t* cmd)
+{
+	static char text[64];
+	char name[24];
+	uint64_t handle = var_handle(cmd->var);
 
-	if (var == NULL)
-		return parse_error(cmd);
+	if (!replay)
+		return command_text();
 
-	// Allocate variable
-	var->mem = buddy_alloc(size);
+	if (handle < TRACE_LETTERS)
+		snprintf(name, sizeof(name), "%c", (int) handle);
+	else
+		snprintf(name, sizeof(name), "h%lu", (unsigned long) (handle - TRACE_LETTERS));
+
+	if (cmd->op == TRACE_OP_ALLOC)
+		snprintf(text, sizeof(text), "%s=alloc(%ld)", name, cmd->size);
+	else
+		snprintf(text, sizeof(text), "free(%s)", name);
 
-	if (var->mem == NULL) {
-		print_fault(cmd, "buddy_alloc returned NULL", WARNING);
-		printf("Out of memory\n");
-		return OUTOFMEMORY;
+	return text;
+}
+
+/**
+ * Parses the size of an allocation instruction. Sizes, after the K
+ * multiplier, must fit in the int buddy_alloc takes.
+ *
+ * @param cur Cursor just past "alloc("
+ * @param cmd Receives the size
+ * @returns Status of the read
+ */
+static status_t parse_alloc(cursor_t* cur, command_t* cmd)
+{
+	if (!read_number(cur, true, INT_MAX, &cmd->size))
+		return parse_error(command_text());
+
+	// Check what follows the size
+	switch (peek(cur)) {
+	case 'k':
+	case 'K':
+		if (labs(cmd->size) > INT_MAX / 1024)
+			return parse_error(command_text());
+		cmd->size *= 1024;
+	case ')':
+		break;
+	default:
+		return parse_error(command_text());
 	}
 
-	var->in_use = true;
+	cmd->op = TRACE_OP_ALLOC;
 
 	return SUCCESS;
 }
@@ -154,111 +422,481 @@ static status_t parse_alloc(char* cmd)
 /**
  * Parses a free instruction
  *
- * @param cmd String representing an allocation command in the program
- * @returns Status of read and execute
+ * @param cur Cursor just past "free("
+ * @param cmd Receives the variable
+ * @returns Status of the read
  */
-static status_t parse_free(char* cmd)
+static status_t parse_free(cursor_t* cur, command_t* cmd)
 {
-	assert(cmd != NULL);
+	if ((cmd->var = get_var(cur)) == NULL)
+		return parse_error(command_text());
 
-	char var_name;
-	int matched;
-	var_t* var;
+	cmd->op = TRACE_OP_FREE;
 
-	// Read the command string
-	errno = 0;
-	matched = sscanf(cmd, "free(%c)", &var_name);
+	return SUCCESS;
+}
 
-	// Check if sscanf was valid
-	if (matched != 1 || errno != 0 || (var = get_var(var_name)) == NULL)
-		return parse_error(cmd);
 
-	// Ensure that the variable is in use
-	if (!var->in_use) {
-		print_fault(cmd, "Double free", ERROR);
-		return DOUBLEFREE;
+/**
+ * Write out the binary records waiting in the buffer
+ */
+static void flush_records()
+{
+	fwrite(records, 1, records_len, records_out);
+	records_len = 0;
+}
+
+/**
+ * Start buffering binary records
+ *
+ * @param out File stream the records are written to
+ */
+static void open_records(FILE* out)
+{
+	if ((records = malloc(WRITE_BUFFER)) == NULL) {
+		fprintf(stderr, "ERROR: Out of memory for binary records\n");
+		exit(EXIT_FAILURE);
 	}
 
-	// Free variable
-	buddy_free(var->mem);
-	var->mem = NULL;
-	var->in_use = false;
+	records_out = out;
+	records_len = 0;
+}
 
-	return SUCCESS;
+/**
+ * Append a varint to the record buffer, see trace_put_varint
+ *
+ * @param value Number to append
+ */
+static void put_varint(uint64_t value)
+{
+	records_len += trace_put_varint(records + records_len, value);
 }
 
+/**
+ * Append a binary record of the free lists to the output. The output starts
+ * with the bytes "BDMP", a version byte of 1, and the smallest and largest
+ * order as bytes. Each record is the line number of the command followed by
+ * the number of free blocks of every order from the smallest up, all as
+ * varints (see trace_put_varint).
+ */
+static void write_record()
+{
+	struct buddy_stats stats;
+
+	buddy_get_stats(&stats);
+
+	if (records == NULL) {
+		open_records(stdout);
+		memcpy(records, "BDMP\1", 5);
+		records[5] = stats.min_order;
+		records[6] = stats.max_order;
+		records_len = 7;
+	}
+
+	if (records_len + RECORD_MAX > WRITE_BUFFER)
+		flush_records();
+
+	put_varint(linenum);
+	for (int order = stats.min_order; order <= stats.max_order; ++order)
+		put_varint(stats.free_blocks[order]);
+}
 
 /**
- * Simplify the command and call one of the sub parser functions
+ * Append a command to the binary trace being converted, see tracefile.h
  *
- * @param cmd Raw command string. This parameter is mutated. This
- * parameter cannot be NULL.
- * @param cmd_len Length in bytes of the command string.
- * @return Program status.
+ * @param cmd Command to append
+ */
+static void write_command(const command_t* cmd)
+{
+	if (records_len + TRACE_RECORD_MAX > WRITE_BUFFER)
+		flush_records();
+
+	put_varint(cmd->op);
+	put_varint(var_handle(cmd->var));
+	if (cmd->op == TRACE_OP_ALLOC)
+		put_varint(trace_zigzag(cmd->size));
+}
+
+/**
+ * Start the binary trace being converted with its header, recording the
+ * orders of the default pool
+ */
+static void start_trace()
+{
+	struct buddy_stats stats;
+
+	buddy_get_stats(&stats);
+	open_records(convert_out);
+
+	memcpy(records, TRACE_MAGIC, 4);
+	records[4] = TRACE_VERSION;
+	records[5] = 0;
+	records[6] = stats.min_order;
+	records[7] = stats.max_order;
+	records_len = TRACE_HEADER_SIZE;
+}
+
+/**
+ * Write out the rest of the binary trace being converted and close it
+ */
+static void end_trace()
+{
+	flush_records();
+	free(records);
+
+	if (fclose(convert_out) != 0)
+		perror("ERROR: Failed to write trace file.");
+}
+
+/**
+ * Report the free lists after a command ran successfully
  */
-static status_t parse_command(char* cmd, int cmd_len)
+static void report_command()
 {
-	assert(cmd != NULL);
+	++commands;
 
-	int ws_cursor = 0;
+	if (output == OUTPUT_BINARY)
+		write_record();
+	else if (dump_every != 0 && commands % dump_every == 0)
+		buddy_dump();
+}
+
+/**
+ * Finish the output: dump the final free lists unless the last command just
+ * did, and write out any binary records still buffered
+ */
+static void report_end()
+{
+	if (output == OUTPUT_BINARY) {
+		if (records != NULL)
+			flush_records();
+		free(records);
+	}
+	else if (dump_every == 0 || commands % dump_every != 0) {
+		buddy_dump();
+	}
+}
 
-	if (cmd[0] == '\0' || cmd[0] == '\n' || cmd[0] == '\r')
+/**
+ * Perform a command, or append it to the binary trace when converting
+ *
+ * @param cmd Command to run
+ * @return Program status.
+ */
+static status_t run_command(const command_t* cmd)
+{
+	var_t* var = cmd->var;
+
+	if (convert_out != NULL) {
+		write_command(cmd);
 		return SUCCESS;
+	}
 
-	// remove whitespace from command
-	for (int i = 0; i < cmd_len; ++i) {
-		switch (cmd[i]) {
-		case ' ':
-		case '\n':
-		case '\r':
-		case '\t':
-			break;
+	if (cmd->op == TRACE_OP_ALLOC) {
+		// Allocate variable
+		var->mem = buddy_alloc((int) cmd->size);
 
-		default:
-			cmd[ws_cursor++] = cmd[i];
+		if (var->mem == NULL) {
+			print_fault(describe_command(cmd), "buddy_alloc returned NULL", WARNING);
+			fprintf(output == OUTPUT_TEXT ? stdout : stderr, "Out of memory\n");
+			return OUTOFMEMORY;
 		}
+
+		var->in_use = true;
 	}
+	else {
+		// Ensure that the variable is in use
+		if (!var->in_use) {
+			print_fault(describe_command(cmd), "Double free", ERROR);
+			return DOUBLEFREE;
+		}
 
-	status_t status;
+		// Free variable
+		buddy_free(var->mem);
+		var->mem = NULL;
+		var->in_use = false;
+	}
+
+	// Output free blocks
+	report_command();
+
+	return SUCCESS;
+}
+
+/**
+ * Parse a command in a single pass and call one of the sub parser functions.
+ *
+ * A command is "x=alloc(size)", where size may end with K, or "free(x)",
+ * with whitespace allowed anywhere. Anything after a complete command is
+ * ignored, but a free command may not mention alloc anywhere.
+ *
+ * @param cmd Receives the command, its op is 0 for a blank line
+ * @return Program status.
+ */
+static status_t parse_command(command_t* cmd)
+{
+	cursor_t cur = line;
+
+	cmd->op = 0;
+
+	if (line.pos == line.end || line.pos[0] == '\r' || line.pos[0] == '\0')
+		return SUCCESS;
 
 	// We have 2 commands: alloc and free.
-	if (strstr(cmd, "alloc") != NULL)
-		status = parse_alloc(cmd);
-	else if (strstr(cmd, "free") != NULL)
-		status = parse_free(cmd);
+	if ((cmd->var = get_var(&cur)) != NULL && accept(&cur, "=alloc("))
+		return parse_alloc(&cur, cmd);
+	else if (contains(&line, "alloc"))
+		return parse_error(command_text());
+	else if (cur = line, accept(&cur, "free("))
+		return parse_free(&cur, cmd);
 	else
-		return parse_error(cmd);
+		return parse_error(command_text());
+}
+
+/**
+ * Map the whole input into memory. Regular files are mapped, anything else
+ * is read into a buffer.
+ *
+ * @param size Receives the number of bytes
+ * @param mapped Receives whether the input was mapped rather than read
+ * @return The input, NULL on failure
+ */
+static char* load_input(size_t* size, bool* mapped)
+{
+	struct stat st;
+	char* data = NULL;
+	size_t capacity = 0;
+	size_t got;
+
+	*size = 0;
+	*mapped = false;
+
+	if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			*size = st.st_size;
+			*mapped = true;
+			return data;
+		}
+		data = NULL;
+	}
 
-	if (status != SUCCESS)
-		return status;
+	do {
+		if (*size == capacity) {
+			char* grown = realloc(data, capacity += READ_CHUNK);
 
-	// Output free blocks
-	buddy_dump();
+			if (grown == NULL) {
+				free(data);
+				return NULL;
+			}
+			data = grown;
+		}
 
-	return SUCCESS;
+		got = fread(data + *size, 1, capacity - *size, in);
+		*size += got;
+	} while (got > 0);
+
+	return data;
 }
 
 /**
- * Feed each line of a file into the function parse_command
+ * Feed each line of the input into the function parse_command and run the
+ * commands
  *
  * @return Program status.
  */
 static status_t parse_file()
 {
-	char* line = NULL;
-	size_t len = 0;
-	ssize_t read;
+	size_t size;
+	bool mapped;
+	char* data = load_input(&size, &mapped);
+	const char* end = data + size;
+	command_t cmd;
 
 	status_t status = SUCCESS;
 
-	while (status == SUCCESS && (read = getline(&line, &len, in)) > 0) {
+	if (data == NULL) {
+		perror("ERROR: Failed to read the input");
+		return BADINPUT;
+	}
+
+	for (line.pos = data; status == SUCCESS && line.pos < end; line.pos = line.end + 1) {
+		const char* newline = memchr(line.pos, '\n', end - line.pos);
+
+		line.end = newline != NULL ? newline : end;
 		++linenum;
-		status = parse_command(line, len);
+
+		if ((status = parse_command(&cmd)) == SUCCESS && cmd.op != 0)
+			status = run_command(&cmd);
 	}
 
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+
 	return status;
 }
 
+/**
+ * Decode the next record of a binary trace
+ *
+ * @param pos Position in the buffer, advanced past the record
+ * @param end End of the bytes read so far
+ * @param flags Flags of the trace header
+ * @param cmd Receives the command
+ * @return True if a whole record was there
+ */
+static bool read_command(const unsigned char** pos, const unsigned char* end, int flags, command_t* cmd)
+{
+	const unsigned char* p = *pos;
+	uint64_t op, handle, size = 0, delay;
+	size_t len;
+
+	if ((len = trace_get_varint(p, end, &op)) == 0)
+		return false;
+	p += len;
+	if ((len = trace_get_varint(p, end, &handle)) == 0)
+		return false;
+	p += len;
+	if (op == TRACE_OP_ALLOC) {
+		if ((len = trace_get_varint(p, end, &size)) == 0)
+			return false;
+		p += len;
+	}
+	if (flags & TRACE_TIMESTAMPS) {
+		if ((len = trace_get_varint(p, end, &delay)) == 0)
+			return false;
+		p += len;
+	}
+
+	cmd->op = op;
+	cmd->size = trace_unzigzag(size);
+	cmd->var = handle < TRACE_LETTERS ? &var_map[handle]
+	         : handle - TRACE_LETTERS < MAX_HANDLES ? get_handle(handle - TRACE_LETTERS) : NULL;
+	*pos = p;
+
+	return true;
+}
+
+/**
+ * Replay a binary trace, reading it in large sequential chunks
+ *
+ * @return Program status.
+ */
+static status_t replay_file()
+{
+	unsigned char header[TRACE_HEADER_SIZE];
+	unsigned char* buffer;
+	const unsigned char* pos;
+	const unsigned char* end;
+	struct buddy_stats stats;
+	command_t cmd;
+	size_t got;
+
+	status_t status = SUCCESS;
+
+	if (fread(header, 1, TRACE_HEADER_SIZE, in) != TRACE_HEADER_SIZE ||
+	    memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION) {
+		fprintf(stderr, "ERROR: Input is not a version %d binary trace\n", TRACE_VERSION);
+		return BADINPUT;
+	}
+
+	buddy_get_stats(&stats);
+	if (header[6] != 0 && (header[6] != stats.min_order || header[7] != stats.max_order))
+		fprintf(stderr, "WARNING: Trace recorded for orders %d-%d, replaying on %d-%d\n",
+		        header[6], header[7], stats.min_order, stats.max_order);
+
+	if ((buffer = malloc(READ_CHUNK)) == NULL) {
+		perror("ERROR: Failed to read the input");
+		return BADINPUT;
+	}
+
+	pos = end = buffer;
+	while (status == SUCCESS) {
+		// keep at least a whole record ahead unless the trace ends first
+		if (end - pos < TRACE_RECORD_MAX) {
+			size_t left = end - pos;
+
+			memmove(buffer, pos, left);
+			got = fread(buffer + left, 1, READ_CHUNK - left, in);
+			pos = buffer;
+			end = buffer + left + got;
+
+			if (left == 0 && got == 0)
+				break;
+		}
+
+		++linenum;
+
+		if (!read_command(&pos, end, header[5], &cmd) ||
+		    (cmd.op != TRACE_OP_ALLOC && cmd.op != TRACE_OP_FREE) || cmd.var == NULL ||
+		    cmd.size > INT_MAX || cmd.size < -INT_MAX) {
+			fprintf(stderr, "ERROR: Record %d: Corrupt or truncated trace record\n", linenum);
+			status = BADINPUT;
+			break;
+		}
+
+		status = run_command(&cmd);
+	}
+
+	free(buffer);
+
+	return status;
+}
+
+
+/**
+ * Print a row of latency percentiles
+ *
+ * @param out File stream to write to.
+ * @param hist Histogram to summarize.
+ */
+static void print_latencies(FILE* out, const struct buddy_histogram* hist)
+{
+	fprintf(out, " %10lu %10.0f %10.0f %10.0f %10.0f\n", (unsigned long) hist->count,
+	        buddy_histogram_percentile(hist, 50), buddy_histogram_percentile(hist, 99),
+	        buddy_histogram_percentile(hist, 99.9), hist->max * hist->ns_per_tick);
+}
+
+/**
+ * Print the alloc and free latencies of the run by order and outcome, if the
+ * allocator keeps histograms (built with USE_HISTOGRAM)
+ *
+ * @param out File stream to write to.
+ */
+static void print_histograms(FILE* out)
+{
+	static const char* ops[BUDDY_HIST_OPS] = {"alloc", "free"};
+	static const char* outcomes[BUDDY_HIST_OUTCOMES] = {"hit", "miss", "split", "merge"};
+	struct buddy_histogram hist;
+
+	if (buddy_histogram_get(BUDDY_HIST_ALLOC, -1, -1, &hist) != 0)
+		return;
+
+	fprintf(out, "%-5s %5s %-5s %10s %10s %10s %10s %10s\n",
+	        "op", "order", "kind", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+	for (int op = 0; op < BUDDY_HIST_OPS; ++op) {
+		for (int order = 0; order < BUDDY_MAX_ORDERS; ++order) {
+			for (int outcome = 0; outcome < BUDDY_HIST_OUTCOMES; ++outcome) {
+				buddy_histogram_get(op, order, outcome, &hist);
+				if (hist.count == 0)
+					continue;
+
+				fprintf(out, "%-5s %5d %-5s", ops[op], order, outcomes[outcome]);
+				print_latencies(out, &hist);
+			}
+		}
+
+		buddy_histogram_get(op, -1, -1, &hist);
+		fprintf(out, "%-5s %5s %-5s", ops[op], "all", "all");
+		print_latencies(out, &hist);
+	}
+}
+
 
 /**
  * Output program manual
@@ -269,17 +907,21 @@ static status_t parse_file()
 void print_usage(char* prog_name, FILE* out)
 {
 	fprintf(out, "Usage:\n");
-	fprintf(out, "  ./%s [-i filename]\n", prog_name);
+	fprintf(out, "  ./%s [-i filename] [-r] [-n count | -q | -b | -c tracefile]\n", prog_name);
 	fprintf(out, "     -i [optional] - Specify an input file name to read from. If this option \n");
 	fprintf(out, "                     is not used then input is expected from standard input.\n");
+	fprintf(out, "     -r [optional] - The input is a binary trace rather than text.\n");
+	fprintf(out, "     -n [optional] - Print the free lists after every count commands and at\n");
+	fprintf(out, "                     the end instead of after every command.\n");
+	fprintf(out, "     -q [optional] - Only print the free lists once, at the end.\n");
+	fprintf(out, "     -b [optional] - Write a binary record of the free lists after every\n");
+	fprintf(out, "                     command instead of text.\n");
+	fprintf(out, "     -c [optional] - Convert the input to a binary trace in tracefile without\n");
+	fprintf(out, "                     running it.\n");
 }
 
 int main(int argc, char** argv)
 {
-
-int blah = 1>>20;
-printf("%d",blah);
-//Jamies stuff below
 	int opt;
 
 	status_t prog_status;
@@ -287,17 +929,48 @@ printf("%d",blah);
 	in = stdin;
 
 	// Parse command line options
-	while ((opt = getopt(argc, argv, "i:")) != -1) {
+	while ((opt = getopt(argc, argv, "i:n:qbc:r")) != -1) {
 		switch (opt) {
 		case 'i':
 			in = fopen(optarg, "r");
 			break;
 
+		case 'n':
+			dump_every = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'q':
+			dump_every = 0;
+			break;
+
+		case 'b':
+			output = OUTPUT_BINARY;
+			break;
+
+		case 'c':
+			if ((convert_out = fopen(optarg, "wb")) == NULL) {
+				perror("ERROR: Failed to open trace file.");
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'r':
+			replay = true;
+			break;
+
 		case '?':
 			switch (optopt) {
 			case 'i':
 				fprintf(stderr, "ERROR: Missing filename after '%c'", optopt);
 				return EXIT_FAILURE;
+
+			case 'n':
+				fprintf(stderr, "ERROR: Missing count after '%c'", optopt);
+				return EXIT_FAILURE;
+
+			case 'c':
+				fprintf(stderr, "ERROR: Missing trace file after '%c'", optopt);
+				return EXIT_FAILURE;
 			}
 
 			print_usage(argv[0], stdout);
@@ -316,11 +989,23 @@ printf("%d",blah);
 
 	// Execute program
 	buddy_init();
-	prog_status = parse_file();
+
+	if (convert_out != NULL)
+		start_trace();
+
+	prog_status = replay ? replay_file() : parse_file();
+
+	if (convert_out != NULL)
+		end_trace();
+	else
+		report_end();
 
 	if (in != stdin)
 		fclose(in);
 
+	print_histograms(stderr);
+	free(handles);
+
 	if (prog_status == SUCCESS)
 		return EXIT_SUCCESS;
 	else
@@ -0,0 +1,377 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buddy.h"
+#include "tracefile.h"
+
+/*
+ * Converts trace events into a simulator trace. The events are read as raw
+ * struct buddy_trace_event records, the way a program writes out the buffer
+ * filled by buddy_trace_drain, and the allocations and frees they describe
+ * are printed as lines the simulator can replay, or with -b written as a
+ * binary trace (see tracefile.h) that keeps the time between events.
+ *
+ * Blocks are numbered with dense handles. Text traces name the first
+ * NUM_NAMES of them with letters and the rest hN, so any number of blocks
+ * may be live. A block resized in place is replayed as a free and an
+ * allocation of the new size under the same name.
+ */
+
+#define NUM_NAMES 52 // letter variables the simulator knows, A-Z and a-z
+
+
+static const char names[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+static struct buddy_trace_event* events;   // Events in the order they were read
+
+/**
+ * Block held by a handle
+ */
+typedef struct slot_t {
+	uint64_t addr;   ///< Block address, 0 if the slot is empty
+	uint64_t handle; ///< Handle number
+} slot_t;
+
+static slot_t* slots;          // Open addressed table of live blocks, by address
+static size_t num_slots;       // Size of slots, a power of two
+static size_t live_slots;      // Blocks in slots
+static uint64_t* free_ids;     // Handle numbers of freed blocks, reused first
+static size_t num_free_ids;    // Entries in free_ids
+static uint64_t next_id;       // Lowest handle number never used
+
+
+/**
+ * Order event indices by timestamp, then by position in the input, which
+ * keeps the events of a thread in the order they were drained
+ */
+static int compare_events(const void* a, const void* b)
+{
+	size_t left = *(const size_t*) a;
+	size_t right = *(const size_t*) b;
+
+	if (events[left].timestamp != events[right].timestamp)
+		return events[left].timestamp < events[right].timestamp ? -1 : 1;
+
+	return (left > right) - (left < right);
+}
+
+/**
+ * Slot a block hashes to
+ */
+static size_t home_slot(uint64_t addr)
+{
+	return (addr * 0x9e3779b97f4a7c15ULL) >> 20 & (num_slots - 1);
+}
+
+/**
+ * Find the slot of a block, or the empty slot where it belongs
+ */
+static slot_t* find_slot(uint64_t addr)
+{
+	size_t i = home_slot(addr);
+
+	while (slots[i].addr != 0 && slots[i].addr != addr)
+		i = (i + 1) & (num_slots - 1);
+
+	return &slots[i];
+}
+
+/**
+ * Give a block the lowest free handle number, keeping the handles dense so
+ * the simulator's handle array stays small
+ *
+ * @param addr Block address
+ * @return Handle number
+ */
+static uint64_t add_handle(uint64_t addr)
+{
+	slot_t* slot;
+
+	if (2 * (live_slots + 1) > num_slots) {
+		slot_t* old = slots;
+		size_t old_size = num_slots;
+
+		num_slots = num_slots ? 2 * num_slots : 1024;
+		if ((slots = calloc(num_slots, sizeof(slot_t))) == NULL) {
+			fprintf(stderr, "ERROR: Out of memory tracking blocks\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (size_t i = 0; i < old_size; ++i)
+			if (old[i].addr != 0)
+				*find_slot(old[i].addr) = old[i];
+		free(old);
+	}
+
+	slot = find_slot(addr);
+	slot->addr = addr;
+	slot->handle = num_free_ids ? free_ids[--num_free_ids] : next_id++;
+	++live_slots;
+
+	return slot->handle;
+}
+
+/**
+ * Release the handle of a block, shifting back the entries that follow it
+ * so lookups never need tombstones
+ *
+ * @param addr Block address
+ * @param handle Receives the handle number
+ * @return False if the block has no handle
+ */
+static bool remove_handle(uint64_t addr, uint64_t* handle)
+{
+	slot_t* slot = num_slots ? find_slot(addr) : NULL;
+	size_t hole, i;
+
+	if (slot == NULL || slot->addr == 0)
+		return false;
+
+	*handle = slot->handle;
+	free_ids[num_free_ids++] = slot->handle;
+	--live_slots;
+
+	hole = i = slot - slots;
+	for (;;) {
+		size_t home;
+
+		i = (i + 1) & (num_slots - 1);
+		if (slots[i].addr == 0)
+			break;
+
+		// move the entry into the hole unless its home lies between the two
+		home = home_slot(slots[i].addr);
+		if (((i - home) & (num_slots - 1)) >= ((i - hole) & (num_slots - 1))) {
+			slots[hole] = slots[i];
+			hole = i;
+		}
+	}
+	slots[hole].addr = 0;
+
+	return true;
+}
+
+/**
+ * Look up the handle of a block
+ *
+ * @param addr Block address
+ * @param handle Receives the handle number
+ * @return False if the block has no handle
+ */
+static bool find_handle(uint64_t addr, uint64_t* handle)
+{
+	slot_t* slot = num_slots ? find_slot(addr) : NULL;
+
+	if (slot == NULL || slot->addr == 0)
+		return false;
+
+	*handle = slot->handle;
+	return true;
+}
+
+/**
+ * Read every event of a file
+ *
+ * @param file Stream to read from
+ * @param count Receives the number of events read
+ * @return Array of events, to be freed by the caller
+ */
+static struct buddy_trace_event* read_events(FILE* file, size_t* count)
+{
+	struct buddy_trace_event* buffer = NULL;
+	size_t capacity = 0;
+
+	*count = 0;
+
+	for (;;) {
+		if (*count == capacity) {
+			capacity = capacity ? 2 * capacity : 4096;
+			buffer = realloc(buffer, capacity * sizeof(*buffer));
+
+			if (buffer == NULL) {
+				fprintf(stderr, "ERROR: Out of memory reading buffer\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		size_t got = fread(&buffer[*count], sizeof(*buffer), capacity - *count, file);
+
+		if (got == 0)
+			break;
+		*count += got;
+	}
+
+	return buffer;
+}
+
+/**
+ * Write a record of a binary trace to standard output
+ *
+ * @param op TRACE_OP_ALLOC or TRACE_OP_FREE
+ * @param handle Handle number of the block
+ * @param event Event recorded
+ */
+static void write_record(int op, uint64_t handle, const struct buddy_trace_event* event)
+{
+	static uint64_t last; // timestamp of the previous record
+	unsigned char record[TRACE_RECORD_MAX];
+	size_t len = 0;
+
+	if (last == 0)
+		last = event->timestamp;
+
+	len += trace_put_varint(record + len, op);
+	len += trace_put_varint(record + len, TRACE_LETTERS + handle);
+	if (op == TRACE_OP_ALLOC)
+		len += trace_put_varint(record + len, trace_zigzag(event->size));
+	len += trace_put_varint(record + len, event->timestamp - last);
+
+	last = event->timestamp;
+	fwrite(record, 1, len, stdout);
+}
+
+/**
+ * Print a line of a text trace
+ *
+ * @param op TRACE_OP_ALLOC or TRACE_OP_FREE
+ * @param handle Handle number of the block
+ * @param event Event recorded
+ */
+static void print_record(int op, uint64_t handle, const struct buddy_trace_event* event)
+{
+	char name[24];
+
+	if (handle < NUM_NAMES)
+		snprintf(name, sizeof(name), "%c", names[handle]);
+	else
+		snprintf(name, sizeof(name), "h%lu", (unsigned long) (handle - NUM_NAMES));
+
+	if (op == TRACE_OP_FREE)
+		printf("free(%s)\n", name);
+	else if (event->size != 0 && event->size % 1024 == 0)
+		printf("%s = alloc(%luK)\n", name, (unsigned long) event->size / 1024);
+	else
+		printf("%s = alloc(%lu)\n", name, (unsigned long) event->size);
+}
+
+/**
+ * Output program manual
+ *
+ * @param prog_name Name of the program passed in as a command line argument.
+ * @param out File stream to write to.
+ */
+static void print_usage(char* prog_name, FILE* out)
+{
+	fprintf(out, "Usage:\n");
+	fprintf(out, "  ./%s [-i filename] [-b]\n", prog_name);
+	fprintf(out, "     -i [optional] - Specify a file of drained trace events to read. If this\n");
+	fprintf(out, "                     option is not used then events are read from standard input.\n");
+	fprintf(out, "     -b [optional] - Write a binary trace with timestamps instead of text.\n");
+}
+
+int main(int argc, char** argv)
+{
+	FILE* in = stdin;
+	size_t* order;
+	size_t count;
+	void (*emit)(int, uint64_t, const struct buddy_trace_event*) = print_record;
+	uint64_t handle;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:b")) != -1) {
+		switch (opt) {
+		case 'i':
+			in = fopen(optarg, "rb");
+			break;
+
+		case 'b':
+			emit = write_record;
+			break;
+
+		default:
+			print_usage(argv[0], stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (in == NULL) {
+		perror("ERROR: Failed to open input file.");
+		return EXIT_FAILURE;
+	}
+
+	events = read_events(in, &count);
+
+	if (in != stdin)
+		fclose(in);
+
+	if ((order = malloc(count * sizeof(size_t) + 1)) == NULL) {
+		fprintf(stderr, "ERROR: Out of memory sorting events\n");
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < count; ++i)
+		order[i] = i;
+	qsort(order, count, sizeof(size_t), compare_events);
+
+	// every handle freed was allocated by an earlier event
+	if ((free_ids = malloc(count * sizeof(uint64_t) + 1)) == NULL) {
+		fprintf(stderr, "ERROR: Out of memory numbering blocks\n");
+		return EXIT_FAILURE;
+	}
+
+	if (emit == write_record) {
+		// the pool orders are not known from the events
+		const unsigned char header[TRACE_HEADER_SIZE] = {
+			'B', 'D', 'T', 'R', TRACE_VERSION, TRACE_TIMESTAMPS, 0, 0
+		};
+
+		fwrite(header, 1, TRACE_HEADER_SIZE, stdout);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		const struct buddy_trace_event* event = &events[order[i]];
+
+		switch (event->type) {
+		case BUDDY_TRACE_ALLOC:
+			if (event->addr == 0) {
+				fprintf(stderr, "WARNING: Event %zu: skipping failed allocation of %lu bytes\n",
+				        i, (unsigned long) event->size);
+				break;
+			}
+
+			emit(TRACE_OP_ALLOC, add_handle(event->addr), event);
+			break;
+
+		case BUDDY_TRACE_FREE:
+			if (remove_handle(event->addr, &handle))
+				emit(TRACE_OP_FREE, handle, event);
+			else
+				fprintf(stderr, "WARNING: Event %zu: skipping free of a block allocated before the trace\n", i);
+			break;
+
+		case BUDDY_TRACE_REALLOC:
+			// the block keeps its name, the simulator has no resize of its own
+			if (find_handle(event->addr, &handle)) {
+				emit(TRACE_OP_FREE, handle, event);
+				emit(TRACE_OP_ALLOC, handle, event);
+			} else {
+				fprintf(stderr, "WARNING: Event %zu: skipping resize of a block allocated before the trace\n", i);
+			}
+			break;
+
+		default:
+			fprintf(stderr, "WARNING: Event %zu: skipping unknown event type %d\n", i, event->type);
+			break;
+		}
+	}
+
+	free(order);
+	free(events);
+	free(free_ids);
+	free(slots);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#ifndef TRACEFILE_H
+#define TRACEFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary simulator traces, replayed with ./buddy -r and written by
+ * ./buddy -c and ./buddy-trace -b.
+ *
+ * A trace starts with an 8 byte header: the bytes "BDTR", a version byte,
+ * a flags byte, and the smallest and largest order of the pool the trace was
+ * recorded against (both 0 if unknown). Every record then holds, as varints:
+ * the op, the handle, for allocations the size zigzag encoded, and if the
+ * header has TRACE_TIMESTAMPS the time since the previous record.
+ *
+ * Handles below TRACE_LETTERS are the letter variables by character code,
+ * handle hN of the text format is N + TRACE_LETTERS.
+ */
+#define TRACE_MAGIC "BDTR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 8
+#define TRACE_TIMESTAMPS 0x01 // header flag: records end with a timestamp delta
+#define TRACE_LETTERS 256
+#define TRACE_RECORD_MAX 40   // longest record, four 10 byte varints
+
+/**
+ * Operations of trace records
+ */
+enum trace_op {
+	TRACE_OP_ALLOC = 1,
+	TRACE_OP_FREE = 2
+};
+
+
+/**
+ * Encode an unsigned LEB128 varint: 7 bits per byte, low bits first, the
+ * high bit set on every byte but the last
+ *
+ * @param out Buffer with room for 10 bytes
+ * @param value Number to encode
+ * @return Bytes written
+ */
+static inline size_t trace_put_varint(unsigned char* out, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		out[len++] = value | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+
+	return len;
+}
+
+/**
+ * Decode an unsigned LEB128 varint
+ *
+ * @param in Start of the varint
+ * @param end End of the readable bytes
+ * @param value Receives the number
+ * @return Bytes read, 0 if the varint runs past end or is longer than 10 bytes
+ */
+static inline size_t trace_get_varint(const unsigned char* in, const unsigned char* end, uint64_t* value)
+{
+	uint64_t result = 0;
+
+	for (size_t len = 0; len < 10 && in + len < end; ++len) {
+		result |= (uint64_t) (in[len] & 0x7f) << (7 * len);
+
+		if ((in[len] & 0x80) == 0) {
+			*value = result;
+			return len + 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Map a signed number to an unsigned one with small magnitudes staying small
+ */
+static inline uint64_t trace_zigzag(int64_t value)
+{
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+/**
+ * Undo trace_zigzag
+ */
+static inline int64_t trace_unzigzag(uint64_t value)
+{
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+#endif // TRACEFILE_H